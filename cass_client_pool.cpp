@@ -1,5 +1,23 @@
 #include "cass_client_pool.h"
 
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <map>
+#include <sstream>
+
+#include "common/base/timestamp.h"
+#include "lock_guard.h"
+#include "thirdparty/boost/thread/thread.hpp"
 #include "thirdparty/gflags/gflags.h"
 #include "thirdparty/glog/logging.h"
 #include "thirdparty/thrift/protocol/TBinaryProtocol.h"
@@ -8,85 +26,416 @@
 
 DEFINE_int32(num_cass_clients, 10,
              "number of Cassandra clients initiated in the client object pool");
+DEFINE_int32(cass_conn_timeout_ms, 1000,
+             "Timeout in ms for connecting to a Cassandra node");
+DEFINE_int32(cass_socket_timeout_ms, 5000,
+             "Default send/recv timeout in ms on Cassandra connections");
+DEFINE_string(cass_keyspace, "offline_keyspace",
+              "Keyspace of the offline message tables");
+DEFINE_bool(cass_qualified_tables, false,
+            "Use keyspace-qualified table names instead of binding every "
+            "connection to --cass_keyspace");
+DEFINE_bool(cass_adaptive_limit, false,
+            "Adapt the in-flight requests per host to the observed RTT");
+DEFINE_int32(cass_limit_initial, 20, "Initial in-flight limit per host");
+DEFINE_int32(cass_limit_min, 2, "Lowest in-flight limit per host");
+DEFINE_int32(cass_limit_max, 200, "Highest in-flight limit per host");
+DEFINE_int32(cass_limit_max_queued, 100,
+             "Requests waiting for a slot on one host before more are shed");
+DEFINE_int32(cass_port, 9160, "Thrift port of the Cassandra nodes");
+DEFINE_string(cass_host_ports, "",
+              "Comma delimited host:port pairs overriding --cass_port");
 
 using namespace ::apache::thrift;
 using namespace ::apache::thrift::protocol;
 using namespace ::org::apache::cassandra;
 
-CassClientPool::CassClientPool(std::string cass_server) {
-  num_clients_ = FLAGS_num_cass_clients;
+namespace {
+
+// Starts a non-blocking connect to |addr|. Returns the socket, or -1.
+int StartConnect(struct addrinfo* addr) {
+  int fd = socket(addr->ai_family, SOCK_STREAM, 0);
+  if (fd < 0)
+    return -1;
+  fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK);
+  if (connect(fd, addr->ai_addr, addr->ai_addrlen) != 0 &&
+      errno != EINPROGRESS) {
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+// Returns true if the connect started by StartConnect succeeded, and puts
+// the socket back into blocking mode for Thrift.
+bool FinishConnect(int fd) {
+  int error = 0;
+  socklen_t length = sizeof(error);
+  if (getsockopt(fd, SOL_SOCKET, SO_ERROR, &error, &length) != 0 || error) {
+    LOG(INFO) << "connect failed: " << strerror(error);
+    return false;
+  }
+  fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) & ~O_NONBLOCK);
+  int one = 1;
+  setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+  return true;
+}
+
+}  // namespace
+
+CassClientPool::CassClientPool(std::string cass_server, int pool_size) {
+  num_clients_ = 0;
+  num_idle_ = 0;
+  num_acquiring_ = 0;
+  draining_ = false;
   cass_server_ = cass_server;
-  ConstructPool(this);
+  cass_port_ = PortFor(cass_server);
+  pool_size_ = pool_size > 0 ? pool_size : FLAGS_num_cass_clients;
+  if (FLAGS_cass_adaptive_limit) {
+    limiter_.reset(new ConcurrencyLimiter(
+        FLAGS_cass_limit_initial, FLAGS_cass_limit_min, FLAGS_cass_limit_max,
+        FLAGS_cass_limit_max_queued));
+  }
+  head_ = NULL;
 } 
 
-void CassClientPool::ConstructPool(CassClientPool* pool) {
-  head_ = new Node(pool);
-  Node* p = NULL;
-  for (int i = 1; i < num_clients_; ++i) {
-    p = new Node(pool);
-    p->next = head_.load();
-    head_ = p;
+void CassClientPool::WarmUp(
+    std::vector<CassClientPool*> const& pools, int timeout_ms,
+    std::tr1::function<void(CassClientPool* pool)> on_live) {
+  struct Pending {
+    CassClientPool* pool;
+    int fd;
+  };
+  std::vector<Pending> pending;
+  for (size_t i = 0; i < pools.size(); ++i) {
+    struct addrinfo hints;
+    struct addrinfo* addr = NULL;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    std::string port = std::to_string(pools[i]->cass_port_);
+    int ret = getaddrinfo(pools[i]->cass_server_.c_str(), port.c_str(),
+                          &hints, &addr);
+    if (ret != 0) {
+      LOG(INFO) << "Can not resolve " << pools[i]->cass_server_ << ": "
+                << gai_strerror(ret);
+      continue;
+    }
+    for (int j = 0; j < pools[i]->pool_size_; ++j) {
+      int fd = StartConnect(addr);
+      if (fd >= 0) {
+        Pending p = { pools[i], fd };
+        pending.push_back(p);
+      }
+    }
+    freeaddrinfo(addr);
+  }
+
+  // Polls in short slices so that draining pools are noticed soon.
+  const int64_t kPollSliceMs = 100;
+  int64_t deadline = GetTimeStampInMs() + timeout_ms;
+  std::vector<struct pollfd> fds;
+  while (!pending.empty()) {
+    int64_t remaining = deadline - GetTimeStampInMs();
+    if (remaining <= 0)
+      break;
+    size_t kept = 0;
+    for (size_t i = 0; i < pending.size(); ++i) {
+      if (pending[i].pool->draining_)
+        close(pending[i].fd);
+      else
+        pending[kept++] = pending[i];
+    }
+    pending.resize(kept);
+    if (pending.empty())
+      break;
+    fds.resize(pending.size());
+    for (size_t i = 0; i < pending.size(); ++i) {
+      fds[i].fd = pending[i].fd;
+      fds[i].events = POLLOUT;
+      fds[i].revents = 0;
+    }
+    if (poll(&fds[0], fds.size(), std::min(remaining, kPollSliceMs)) < 0) {
+      if (errno == EINTR)
+        continue;
+      PLOG(ERROR) << "poll failed during pool warm-up";
+      break;
+    }
+
+    // The keyspace is bound lazily with the first request, so a connected
+    // socket is immediately usable.
+    std::vector<Pending> still_pending;
+    for (size_t i = 0; i < pending.size(); ++i) {
+      Pending& p = pending[i];
+      if (fds[i].revents == 0) {
+        still_pending.push_back(p);
+      } else if (FinishConnect(p.fd)) {
+        p.pool->AddNode(new Node(p.pool,
+            boost::shared_ptr<TSocket>(new TSocket(p.fd))));
+        on_live(p.pool);
+      } else {
+        close(p.fd);
+      }
+    }
+    pending.swap(still_pending);
   }
+
+  for (size_t i = 0; i < pending.size(); ++i)
+    close(pending[i].fd);
+  if (!pending.empty())
+    LOG(INFO) << pending.size() << " connections timed out during warm-up";
 }
 
-CassClientPool::Node::Node(CassClientPool* pool) {
-  cass_server = pool->cass_server_; 
-  next = NULL;
-  boost::shared_ptr<TTransport> socket;
-  boost::shared_ptr<TProtocol> protocol;
+bool CassClientPool::IsHostDown(TTransportException const& te) {
+  return te.getType() == TTransportException::NOT_OPEN ||
+         te.getType() == TTransportException::END_OF_FILE;
+}
+
+int CassClientPool::PortFor(std::string const& cass_server) {
+  static std::map<std::string, int> ports = [] {
+    std::map<std::string, int> parsed;
+    std::stringstream list(FLAGS_cass_host_ports);
+    std::string pair;
+    while (std::getline(list, pair, ',')) {
+      size_t colon = pair.rfind(':');
+      if (colon != std::string::npos)
+        parsed[pair.substr(0, colon)] = atoi(pair.c_str() + colon + 1);
+    }
+    return parsed;
+  }();
+  auto it = ports.find(cass_server);
+  return it == ports.end() ? FLAGS_cass_port : it->second;
+}
+
+std::string CassClientPool::TableName(std::string const& table) {
+  if (FLAGS_cass_qualified_tables)
+    return FLAGS_cass_keyspace + "." + table;
+  return table;
+}
+
+CassClientPool::Node::Node(CassClientPool* pool, int conn_timeout_ms)
+    : Node(pool, boost::shared_ptr<TSocket>(
+                     new TSocket(pool->cass_server_, pool->cass_port_))) {
+  socket->setConnTimeout(conn_timeout_ms);
 
   try {
-    socket = boost::shared_ptr<TSocket>(
-        new TSocket(cass_server, 9160));
-    transport = boost::shared_ptr<TFramedTransport>(
-        new TFramedTransport(socket));
-    protocol = boost::shared_ptr<TBinaryProtocol>(
-        new TBinaryProtocol(transport));
-    client = boost::shared_ptr<CassandraClient>(new CassandraClient(protocol));
-   
     transport->open();
-    std::string query = "USE offline_keyspace;";
-    CqlResult result;
-    client->execute_cql3_query(result, query, Compression::NONE,
-                               ConsistencyLevel::ONE); 
   } catch (TTransportException& te) {
     LOG(INFO) << "TTransportException: " << te.what()
               << " [" << te.getType() << "]";
+    host_down = IsHostDown(te);
+  }
+}
+
+CassClientPool::Node::Node(CassClientPool* pool,
+                           boost::shared_ptr<TSocket> sock) {
+  cass_server = pool->cass_server_; 
+  next = NULL;
+  keyspace_bound = FLAGS_cass_qualified_tables;
+  last_rtt_us = 0;
+  host_down = false;
+  socket = sock;
+  socket->setSendTimeout(FLAGS_cass_socket_timeout_ms);
+  socket->setRecvTimeout(FLAGS_cass_socket_timeout_ms);
+  transport = boost::shared_ptr<TFramedTransport>(
+      new TFramedTransport(socket));
+  boost::shared_ptr<TProtocol> protocol =
+      boost::shared_ptr<TBinaryProtocol>(new TBinaryProtocol(transport));
+  client = boost::shared_ptr<CassandraClient>(new CassandraClient(protocol));
+}
+
+void CassClientPool::Node::Execute(CqlResult& result, std::string const& query,
+                                   Compression::type compression,
+                                   ConsistencyLevel::type consistency) {
+  int64_t start_time = GetTimeStampInUs();
+  if (keyspace_bound) {
+    client->execute_cql3_query(result, query, compression, consistency);
+    last_rtt_us = GetTimeStampInUs() - start_time;
+    return;
+  }
+  // Pipeline set_keyspace with the first query so binding the connection
+  // costs no extra round trip. Both replies must be read to keep the
+  // connection in sync, even if set_keyspace fails.
+  client->send_set_keyspace(FLAGS_cass_keyspace);
+  client->send_execute_cql3_query(query, compression, consistency);
+  try {
+    client->recv_set_keyspace();
   } catch (InvalidRequestException& ire) {
-    LOG(INFO) << "InvalidRequestException: " << ire.what()
-              << " [" << ire.why.c_str() << "]";
+    // The query ran without a keyspace, so it normally fails too. Only
+    // Cassandra's own errors mean its reply was read completely; anything
+    // else propagates so that the caller discards the connection.
+    try {
+      client->recv_execute_cql3_query(result);
+    } catch (InvalidRequestException&) {
+    } catch (UnavailableException&) {
+    } catch (TimedOutException&) {
+    } catch (SchemaDisagreementException&) {
+    }
+    throw;
+  }
+  keyspace_bound = true;
+  client->recv_execute_cql3_query(result);
+  last_rtt_us = GetTimeStampInUs() - start_time;
+}
+
+void CassClientPool::Node::SetDeadline(int64_t deadline_ms) {
+  int timeout = FLAGS_cass_socket_timeout_ms;
+  if (deadline_ms > 0) {
+    int64_t remaining = deadline_ms - GetTimeStampInMs();
+    if (remaining < timeout)
+      timeout = remaining > 0 ? remaining : 1;
+  }
+  socket->setSendTimeout(timeout);
+  socket->setRecvTimeout(timeout);
+}
+
+CassClientPool::Node* CassClientPool::AcquireNode(int64_t deadline_ms,
+                                                  bool* shed,
+                                                  bool* host_down) {
+  // Counted before the check, so Drain either waits for this call or the
+  // call sees draining_.
+  std::atomic_fetch_add(&num_acquiring_, static_cast<size_t>(1));
+  Node* node = NULL;
+  if (!draining_ && (!limiter_ || limiter_->Acquire(deadline_ms, shed))) {
+    node = PopNode();
+    if (node != NULL)
+      node->last_rtt_us = 0;
+    else
+      node = OpenNode(deadline_ms, host_down);
   }
+  std::atomic_fetch_sub(&num_acquiring_, static_cast<size_t>(1));
+  if (draining_)
+    NotifyDrain();
+  return node;
 }
 
-CassClientPool::Node* CassClientPool::AcquireNode() {
-  for (;;) {
-    Node* h = head_.load();
-    if (h == NULL) {
-      std::atomic_fetch_add(&num_clients_, static_cast<size_t>(1));
-      return new Node(this); 
+CassClientPool::Node* CassClientPool::OpenNode(int64_t deadline_ms,
+                                               bool* host_down) {
+  // With the limiter on, this only happens while the limit is above the
+  // number of open connections, so overload can not inflate the pool.
+  int conn_timeout = FLAGS_cass_conn_timeout_ms;
+  if (deadline_ms > 0) {
+    int64_t remaining = deadline_ms - GetTimeStampInMs();
+    if (remaining <= 0) {
+      if (limiter_)
+        limiter_->Release(0, false);
+      return NULL;
     }
-    Node* next = h->next.load();
-    if (head_.compare_exchange_weak(h, next))
-      return h;
+    if (remaining < conn_timeout)
+      conn_timeout = remaining;
+  }
+  std::atomic_fetch_add(&num_clients_, static_cast<size_t>(1));
+  Node* node = new Node(this, conn_timeout);
+  if (!node->IsOpen()) {
+    if (host_down != NULL)
+      *host_down = node->host_down;
+    DiscardNode(node);
+    return NULL;
   }
+  return node;
 }
 
-void CassClientPool::ReturnNode(Node* node) {
-  for (;;) {
-    Node* h = head_.load();
-    node->next = h;
-    if (head_.compare_exchange_weak(h, node))
-      return;
+void CassClientPool::ReturnNode(Node* node, bool timed_out) {
+  if (limiter_)
+    limiter_->Release(timed_out ? 0 : node->last_rtt_us, timed_out);
+  // Once draining, CloseIdle may have run already, so the node is closed
+  // here instead of waiting in the pool for a close that never comes.
+  if (draining_) {
+    CloseNode(node);
+    NotifyDrain();
+    return;
   }
+  PushNode(node);
 }
 
-CassClientPool::~CassClientPool() {
+CassClientPool::Node* CassClientPool::PopNode() {
+  LockGuard<boost::mutex> lock(idle_mutex_);
+  Node* node = head_;
+  if (node != NULL) {
+    head_ = node->next;
+    std::atomic_fetch_sub(&num_idle_, static_cast<size_t>(1));
+  }
+  return node;
+}
+
+void CassClientPool::PushNode(Node* node) {
+  LockGuard<boost::mutex> lock(idle_mutex_);
+  node->next = head_;
+  head_ = node;
+  std::atomic_fetch_add(&num_idle_, static_cast<size_t>(1));
+}
+
+void CassClientPool::CloseNode(Node* node) {
+  node->transport->close();
+  delete node;
+  std::atomic_fetch_sub(&num_clients_, static_cast<size_t>(1));
+}
+
+void CassClientPool::AddNode(Node* node) {
+  if (draining_) {
+    node->transport->close();
+    delete node;
+    return;
+  }
+  std::atomic_fetch_add(&num_clients_, static_cast<size_t>(1));
+  PushNode(node);
+}
+
+bool CassClientPool::Drain(int64_t deadline_ms) {
+  draining_ = true;
+  boost::chrono::steady_clock::time_point deadline =
+      boost::chrono::steady_clock::now() +
+      boost::chrono::milliseconds(deadline_ms - GetTimeStampInMs());
+  boost::unique_lock<boost::mutex> lock(drain_mutex_);
+  while (!DrainedLocked()) {
+    if (drain_cond_.wait_until(lock, deadline) == boost::cv_status::timeout)
+      return DrainedLocked();
+  }
+  return true;
+}
+
+// Requires drain_mutex_, which only orders the check against NotifyDrain.
+bool CassClientPool::DrainedLocked() {
+  return num_acquiring_.load() == 0 &&
+         num_idle_.load() >= num_clients_.load();
+}
+
+void CassClientPool::NotifyDrain() {
+  LockGuard<boost::mutex> lock(drain_mutex_);
+  drain_cond_.notify_all();
+}
+
+void CassClientPool::CloseIdle() {
   Node* h;
-  for (size_t i = 0; i < num_clients_; ++i) {
-    h = head_.load();
+  {
+    LockGuard<boost::mutex> lock(idle_mutex_);
+    h = head_;
+    head_ = NULL;
+  }
+  // Unlinked, so the nodes are closed without holding the lock.
+  while (h != NULL) {
+    Node* next = h->next;
     h->transport->close();
-    head_ = h->next.load();
     delete h;
+    std::atomic_fetch_sub(&num_idle_, static_cast<size_t>(1));
+    std::atomic_fetch_sub(&num_clients_, static_cast<size_t>(1));
+    h = next;
   }
 }
 
+void CassClientPool::DiscardNode(Node* node) {
+  if (limiter_)
+    limiter_->Release(0, true);
+  CloseNode(node);
+  if (draining_)
+    NotifyDrain();
+}
+
+CassClientPool::~CassClientPool() {
+  CloseIdle();
+  // Checked out nodes can not be freed here; their owners still use them.
+  if (num_clients_ > 0)
+    LOG(WARNING) << num_clients_ << " connections to " << cass_server_
+                 << " still checked out";
+}
+
@@ -4,10 +4,13 @@
 #include "Cassandra.h"
 
 #include <stddef.h>
+#include <stdint.h>
 
 #include <atomic>
 #include <vector>
 
+#include "concurrency_limiter.h"
+#include "thirdparty/thrift/transport/TSocket.h"
 #include "thirdparty/thrift/transport/TTransportUtils.h"
 
 using namespace ::apache::thrift::transport;
@@ -17,26 +20,105 @@ class CassClientPool {
  public:
   struct Node {
     boost::shared_ptr<CassandraClient> client;
-    std::atomic<Node*> next;
+    Node* next;  // in the idle list, guarded by idle_mutex_
     boost::shared_ptr<TTransport> transport;
+    boost::shared_ptr<TSocket> socket;
     std::string cass_server;
+    // False until set_keyspace has been sent on this connection.
+    bool keyspace_bound;
+    // Round trip of the last Execute since this node was acquired, or 0.
+    int64_t last_rtt_us;
+    // Whether opening this connection failed because the host refused or
+    // closed it.
+    bool host_down;
 
-    Node(CassClientPool* pool);
+    // Opens a new connection, blocking for at most |conn_timeout_ms|.
+    Node(CassClientPool* pool, int conn_timeout_ms);
+    // Wraps |sock|, which is connected already.
+    Node(CassClientPool* pool, boost::shared_ptr<TSocket> sock);
+    bool IsOpen() { return transport->isOpen(); }
+    // Bounds the next send/recv on this connection by |deadline_ms|.
+    void SetDeadline(int64_t deadline_ms);
+    // execute_cql3_query that binds the connection to --cass_keyspace on
+    // first use unless --cass_qualified_tables is set.
+    void Execute(CqlResult& result, std::string const& query,
+                 Compression::type compression,
+                 ConsistencyLevel::type consistency);
   };
 
-  CassClientPool(std::string cass_server);
+  // The pool starts empty; fill it with WarmUp. Until then AcquireNode
+  // opens connections on demand. |pool_size| connections are opened by
+  // WarmUp, --num_cass_clients if 0.
+  CassClientPool(std::string cass_server, int pool_size = 0);
   ~CassClientPool();
-  
-  Node* AcquireNode();
-  void ReturnNode(Node* node);
+
+  // Opens the configured number of connections for every pool in |pools|
+  // concurrently: all connects are non-blocking and multiplexed on one
+  // poll(). |on_live| is called each time a connection becomes usable.
+  // Gives up after |timeout_ms|, and on the pools that start draining.
+  static void WarmUp(std::vector<CassClientPool*> const& pools,
+                     int timeout_ms,
+                     std::tr1::function<void(CassClientPool* pool)> on_live);
+
+  // Returns NULL if no pooled node is free and a new connection can not be
+  // opened before |deadline_ms| (0 means no deadline). With
+  // --cass_adaptive_limit, also returns NULL when the host is at its
+  // in-flight limit and no slot frees up before the deadline, or at once
+  // with |*shed| set to true when too many requests wait for one already.
+  // |*host_down| is set to true only when NULL is returned because the
+  // host refused or closed a new connection, not when the pool is draining
+  // or the deadline passed.
+  Node* AcquireNode(int64_t deadline_ms = 0, bool* shed = NULL,
+                    bool* host_down = NULL);
+  // |timed_out| tells the limiter that the host did not answer in time
+  // although the connection is fine, e.g. a coordinator TimedOutException.
+  void ReturnNode(Node* node, bool timed_out = false);
+  // Closes and frees a node whose connection is broken or timed out
+  // instead of putting it back into the pool.
+  void DiscardNode(Node* node);
+  // Adds a newly opened node to the pool, or closes it once draining.
+  void AddNode(Node* node);
+  // Stops handing out nodes and waits until |deadline_ms| for the checked
+  // out ones to come back. Returns whether they all did; the ones that
+  // come back later are closed by ReturnNode.
+  bool Drain(int64_t deadline_ms);
+  // Closes and frees the nodes that are in the pool.
+  void CloseIdle();
+  // Whether |te| means the host refused or closed the connection, as
+  // opposed to a request running out of time on it.
+  static bool IsHostDown(TTransportException const& te);
+  // Thrift port of |cass_server| from --cass_host_ports or --cass_port.
+  static int PortFor(std::string const& cass_server);
+  // |table| as it must appear in CQL: qualified with --cass_keyspace when
+  // --cass_qualified_tables is set.
+  static std::string TableName(std::string const& table);
   std::string cass_server_;
+  int cass_port_;
+  int pool_size_;
 
  private:
-  void ConstructPool(CassClientPool* pool);
-  void IncreaseNumClients();
+  // Opens a connection for AcquireNode when the pool is empty.
+  Node* OpenNode(int64_t deadline_ms, bool* host_down);
+  // Take a node from or put one back into the idle list.
+  Node* PopNode();
+  void PushNode(Node* node);
+  void CloseNode(Node* node);
+  bool DrainedLocked();
+  void NotifyDrain();
 
-  std::atomic<Node*> head_;
+  // A plain locked list: a lock-free stack could not free nodes safely
+  // while another thread is popping, and the critical sections are a few
+  // pointer moves next to a network round trip.
+  boost::mutex idle_mutex_;
+  Node* head_;  // idle nodes, guarded by idle_mutex_
   std::atomic<size_t> num_clients_;
+  std::atomic<size_t> num_idle_;
+  // AcquireNode calls past their draining_ check, which may still pop.
+  std::atomic<size_t> num_acquiring_;
+  std::atomic<bool> draining_;
+  boost::mutex drain_mutex_;
+  boost::condition_variable drain_cond_;
+  boost::shared_ptr<ConcurrencyLimiter> limiter_;  // NULL if disabled
 };
 
 #endif // CASS_CLIENT_POOL_H_
@@ -5,9 +5,12 @@
 #include <string>
 #include <vector>
 
+#include "cass_client_pool.h"
 #include "common/base/timestamp.h"
 #include "common/idl/message_types.h"
+#include "query_compressor.h"
 #include "random_message.h"
+#include "stress_coordinator.h"
 #include "thirdparty/boost/thread/thread.hpp"
 #include "thirdparty/gflags/gflags.h"
 #include "thirdparty/glog/logging.h"
@@ -15,6 +18,9 @@
 #include "thirdparty/thrift/transport/TSocket.h"
 #include "thirdparty/thrift/transport/TTransportUtils.h"
 
+DECLARE_string(cass_keyspace);
+DECLARE_bool(cass_qualified_tables);
+
 DEFINE_int32(thread_count, 1, "Number of client threads");
 DEFINE_int32(operation_count, 10000, "Count of operations");
 DEFINE_string(operation_type, "INSERT",
@@ -57,18 +63,16 @@ void CassandraStressClient::Setup(std::string const& server_ip) {
   success_count_ = 0;
   latencies_.reset(new double[FLAGS_operation_count/FLAGS_thread_count]);
   try {
-    boost::shared_ptr<TTransport> socket =
-        boost::shared_ptr<TSocket>(new TSocket(server_ip, 9160));
+    boost::shared_ptr<TTransport> socket(
+        new TSocket(server_ip, CassClientPool::PortFor(server_ip)));
     transport_ = boost::shared_ptr<TFramedTransport>(
         new TFramedTransport(socket));
     boost::shared_ptr<TProtocol> protocol =
         boost::shared_ptr<TBinaryProtocol>(new TBinaryProtocol(transport_));
     client_.reset(new CassandraClient(protocol));
     transport_->open();
-    std::string query = "USE offline_keyspace";
-    CqlResult result;
-    client_->execute_cql3_query(result, query, Compression::NONE,
-                                ConsistencyLevel::ONE);
+    if (!FLAGS_cass_qualified_tables)
+      client_->set_keyspace(FLAGS_cass_keyspace);
   } catch (TTransportException& te) {
     printf("Exception: %s [%d]\n", te.what(), te.getType());
   } catch (InvalidRequestException& ire) {
@@ -80,12 +84,14 @@ void CassandraStressClient::StoreMessage(Message const& message,
                                          size_t index) {
   try {
     CqlResult result;
-    std::string query = "INSERT INTO receiver_table(receiver_id, ts, msg_id,"
-        "group_id, msg, sender_id) VALUES('" + message.receiver_id + "','" +
+    std::string query = "INSERT INTO " +
+        CassClientPool::TableName("receiver_table") + "(receiver_id, ts, "
+        "msg_id, group_id, msg, sender_id) VALUES('" + message.receiver_id + "','" +
         message.timestamp + "','" + message.msg_id + "','" + message.group_id
         + "','" + message.msg + "','" + message.sender_id + "');";
     int64_t start_time = GetTimeStampInUs();
-    client_->execute_cql3_query(result, query, Compression::NONE,
+    Compression::type compression = CompressQuery(&query);
+    client_->execute_cql3_query(result, query, compression,
                                 ConsistencyLevel::ONE);
     int64_t end_time = GetTimeStampInUs();
     double latency = (end_time - start_time) / 1000.0;
@@ -103,10 +109,12 @@ void CassandraStressClient::RetrieveMessage(std::string const& receiver,
                                             size_t index) {
   try {
     CqlResult result;
-    std::string query = "SELECT * FROM receiver_table WHERE receiver_id = '"
-                        + receiver + "';";
+    std::string query = "SELECT * FROM " +
+        CassClientPool::TableName("receiver_table") + " WHERE receiver_id = '"
+        + receiver + "';";
     int64_t start_time = GetTimeStampInUs();
-    client_->execute_cql3_query(result, query, Compression::NONE,
+    Compression::type compression = CompressQuery(&query);
+    client_->execute_cql3_query(result, query, compression,
                                 ConsistencyLevel::ONE);
     int64_t end_time = GetTimeStampInUs();
     double latency = (end_time - start_time) / 1000.0;
@@ -153,6 +161,10 @@ double RankLatency(double rank, double* arr, size_t size) {
 int main(int argc, char** argv) {
   google::InitGoogleLogging(argv[0]);
   google::ParseCommandLineFlags(&argc, &argv, false);
+  if (StressCoordinator::Enabled()) {
+    StressCoordinator coordinator;
+    return coordinator.Run(argv) ? 0 : 1;
+  }
 
   std::vector<std::string> cass_servers;
   std::string addresses = FLAGS_cass_servers_ip;
@@ -178,6 +190,9 @@ int main(int argc, char** argv) {
     }
   }
   size_t loop_count = FLAGS_operation_count / FLAGS_thread_count;
+  StressWorker stress_worker;
+  if (StressWorker::Enabled() && !stress_worker.WaitForStart())
+    return 1;
 
   std::vector<boost::thread*> client_threads;
   int64_t stress_start_time = GetTimeStampInMs();
@@ -227,6 +242,24 @@ int main(int argc, char** argv) {
   LOG(INFO) << ".999 latency: "
             << RankLatency(0.999, latency_array, FLAGS_operation_count)
             << " ms";
+  CompressionStats compression_stats;
+  GetCompressionStats(&compression_stats);
+  LOG(INFO) << "Compressed queries: " << compression_stats.compressed_count
+            << ", uncompressed: " << compression_stats.skipped_count;
+  LOG(INFO) << "Query bytes: " << compression_stats.raw_bytes
+            << ", on the wire: " << compression_stats.wire_bytes;
+  LOG(INFO) << "Compression CPU: "
+            << compression_stats.compress_time_us / 1000.0 << " ms";
+  if (StressWorker::Enabled()) {
+    StressReport report;
+    report.operations = FLAGS_operation_count;
+    report.successes = success_count;
+    report.elapsed_ms = stress_end_time - stress_start_time;
+    for (size_t i = 0; i < FLAGS_operation_count; ++i)
+      report.latencies.Record(latency_array[i] * 1000);
+    if (!stress_worker.SendReport(report))
+      LOG(ERROR) << "Failed to report to the stress coordinator";
+  }
   delete [] latency_array;
 
   for (int i = 0; i < FLAGS_thread_count; ++i) {
@@ -0,0 +1,129 @@
+#include "completion_executor.h"
+
+#include <algorithm>
+
+#include "lock_guard.h"
+
+namespace {
+
+// Identifies the executor and worker the calling thread belongs to.
+thread_local CompletionExecutor* current_executor = NULL;
+thread_local size_t current_worker = 0;
+
+}  // namespace
+
+CompletionExecutor::CompletionExecutor(int num_workers, int batch_size)
+    : batch_size_(batch_size > 0 ? batch_size : 1), next_worker_(0),
+      pending_(0), idle_workers_(0), stopped_(false), submitted_(0),
+      executed_(0), stolen_(0) {
+  for (int i = 0; i < num_workers; ++i)
+    workers_.push_back(boost::shared_ptr<Worker>(new Worker));
+  for (int i = 0; i < num_workers; ++i)
+    threads_.push_back(new boost::thread(&CompletionExecutor::Run, this, i));
+}
+
+CompletionExecutor::~CompletionExecutor() {
+  Stop();
+}
+
+void CompletionExecutor::Submit(Task const& task) {
+  if (stopped_ || workers_.empty()) {
+    task();
+    return;
+  }
+  size_t index = current_executor == this ?
+      current_worker : std::atomic_fetch_add(&next_worker_,
+                                             static_cast<size_t>(1));
+  Worker* worker = workers_[index % workers_.size()].get();
+  {
+    LockGuard<boost::mutex> lock(worker->mutex);
+    worker->tasks.push_back(task);
+  }
+  std::atomic_fetch_add(&submitted_, static_cast<uint64_t>(1));
+  std::atomic_fetch_add(&pending_, static_cast<size_t>(1));
+  // Pairs with the idle check in Run: either the worker sees pending_ or
+  // we see it idle and wake it.
+  if (idle_workers_.load() > 0) {
+    LockGuard<boost::mutex> lock(idle_mutex_);
+    idle_cond_.notify_one();
+  }
+}
+
+void CompletionExecutor::Stop() {
+  {
+    LockGuard<boost::mutex> lock(idle_mutex_);
+    if (stopped_.exchange(true))
+      return;
+    idle_cond_.notify_all();
+  }
+  for (size_t i = 0; i < threads_.size(); ++i) {
+    threads_[i]->join();
+    delete threads_[i];
+  }
+  threads_.clear();
+}
+
+void CompletionExecutor::GetStats(Stats* stats) {
+  stats->submitted = submitted_.load();
+  stats->executed = executed_.load();
+  stats->stolen = stolen_.load();
+  stats->queue_depth = pending_.load();
+  stats->max_worker_depth = 0;
+  for (size_t i = 0; i < workers_.size(); ++i) {
+    LockGuard<boost::mutex> lock(workers_[i]->mutex);
+    stats->max_worker_depth = std::max<uint64_t>(stats->max_worker_depth,
+                                                 workers_[i]->tasks.size());
+  }
+}
+
+void CompletionExecutor::Run(size_t index) {
+  current_executor = this;
+  current_worker = index;
+  std::vector<Task> batch;
+  for (;;) {
+    if (TakeLocal(index, &batch) || Steal(index, &batch)) {
+      std::atomic_fetch_sub(&pending_, batch.size());
+      for (size_t i = 0; i < batch.size(); ++i)
+        batch[i]();
+      std::atomic_fetch_add(&executed_, static_cast<uint64_t>(batch.size()));
+      batch.clear();
+      continue;
+    }
+    boost::unique_lock<boost::mutex> lock(idle_mutex_);
+    std::atomic_fetch_add(&idle_workers_, static_cast<size_t>(1));
+    while (pending_.load() == 0 && !stopped_)
+      idle_cond_.wait(lock);
+    std::atomic_fetch_sub(&idle_workers_, static_cast<size_t>(1));
+    if (pending_.load() == 0 && stopped_)
+      return;
+  }
+}
+
+bool CompletionExecutor::TakeLocal(size_t index, std::vector<Task>* batch) {
+  Worker* worker = workers_[index].get();
+  LockGuard<boost::mutex> lock(worker->mutex);
+  while (!worker->tasks.empty() && batch->size() < batch_size_) {
+    batch->push_back(worker->tasks.front());
+    worker->tasks.pop_front();
+  }
+  return !batch->empty();
+}
+
+// Takes up to half of the first non-empty victim's tasks, oldest last, so
+// the victim keeps working on the front of its deque undisturbed.
+bool CompletionExecutor::Steal(size_t index, std::vector<Task>* batch) {
+  for (size_t i = 1; i < workers_.size(); ++i) {
+    Worker* victim = workers_[(index + i) % workers_.size()].get();
+    LockGuard<boost::mutex> lock(victim->mutex);
+    size_t n = std::min(batch_size_, (victim->tasks.size() + 1) / 2);
+    for (size_t j = 0; j < n; ++j) {
+      batch->push_back(victim->tasks.back());
+      victim->tasks.pop_back();
+    }
+    if (n > 0) {
+      std::atomic_fetch_add(&stolen_, static_cast<uint64_t>(n));
+      return true;
+    }
+  }
+  return false;
+}
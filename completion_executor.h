@@ -0,0 +1,66 @@
+#ifndef COMPLETION_EXECUTOR_H_
+#define COMPLETION_EXECUTOR_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <atomic>
+#include <deque>
+#include <vector>
+
+#include "thirdparty/boost/thread.hpp"
+
+// Work-stealing thread pool that runs request callbacks away from the
+// threads doing Cassandra I/O. Every worker owns a deque: it takes tasks
+// from the front in batches and, when it runs dry, steals from the back of
+// the other workers' deques.
+class CompletionExecutor {
+ public:
+  typedef std::tr1::function<void()> Task;
+
+  struct Stats {
+    uint64_t submitted;
+    uint64_t executed;
+    uint64_t stolen;
+    uint64_t queue_depth;       // tasks waiting across all workers
+    uint64_t max_worker_depth;  // longest single deque
+  };
+
+  CompletionExecutor(int num_workers, int batch_size);
+  ~CompletionExecutor();
+
+  // Tasks submitted from a worker go to that worker's own deque, others are
+  // spread round-robin.
+  void Submit(Task const& task);
+  // Runs what is still queued and joins the workers. Tasks submitted
+  // afterwards run inline; submitting concurrently with Stop is not
+  // supported.
+  void Stop();
+  size_t QueueDepth() { return pending_.load(); }
+  void GetStats(Stats* stats);
+
+ private:
+  struct Worker {
+    boost::mutex mutex;
+    std::deque<Task> tasks;
+  };
+
+  void Run(size_t index);
+  bool TakeLocal(size_t index, std::vector<Task>* batch);
+  bool Steal(size_t index, std::vector<Task>* batch);
+
+  std::vector<boost::shared_ptr<Worker>> workers_;
+  std::vector<boost::thread*> threads_;
+  size_t batch_size_;
+  std::atomic<size_t> next_worker_;
+  std::atomic<size_t> pending_;
+  std::atomic<size_t> idle_workers_;
+  std::atomic<bool> stopped_;
+  boost::mutex idle_mutex_;
+  boost::condition_variable idle_cond_;
+  std::atomic<uint64_t> submitted_;
+  std::atomic<uint64_t> executed_;
+  std::atomic<uint64_t> stolen_;
+};
+
+#endif // COMPLETION_EXECUTOR_H_
@@ -0,0 +1,99 @@
+#include "concurrency_limiter.h"
+
+#include <math.h>
+
+#include <algorithm>
+
+#include "common/base/timestamp.h"
+#include "lock_guard.h"
+
+namespace {
+
+// Weight of a new sample in the long-term RTT, about a 500-request window.
+const double kLongRttWeight = 0.002;
+// Weight of a new estimate in the limit, to damp oscillation.
+const double kSmoothing = 0.2;
+// Multiplicative decrease on timeouts and broken connections.
+const double kBackoffRatio = 0.9;
+
+}  // namespace
+
+ConcurrencyLimiter::ConcurrencyLimiter(int initial_limit, int min_limit,
+                                       int max_limit, int max_queued)
+    : limit_(initial_limit), min_limit_(min_limit), max_limit_(max_limit),
+      max_queued_(max_queued), in_flight_(0), waiting_(0), long_rtt_us_(0) {
+}
+
+bool ConcurrencyLimiter::Acquire(int64_t deadline_ms, bool* shed) {
+  boost::unique_lock<boost::mutex> lock(mutex_);
+  if (in_flight_ < static_cast<int>(limit_)) {
+    ++in_flight_;
+    return true;
+  }
+  if (waiting_ >= max_queued_) {
+    if (shed != NULL)
+      *shed = true;
+    return false;
+  }
+  ++waiting_;
+  while (in_flight_ >= static_cast<int>(limit_)) {
+    if (deadline_ms > 0) {
+      int64_t remaining = deadline_ms - GetTimeStampInMs();
+      if (remaining <= 0 ||
+          slot_freed_.wait_for(lock, boost::chrono::milliseconds(remaining))
+              == boost::cv_status::timeout) {
+        if (in_flight_ < static_cast<int>(limit_))
+          break;
+        --waiting_;
+        return false;
+      }
+    } else {
+      slot_freed_.wait(lock);
+    }
+  }
+  --waiting_;
+  ++in_flight_;
+  return true;
+}
+
+void ConcurrencyLimiter::Release(int64_t rtt_us, bool dropped) {
+  {
+    LockGuard<boost::mutex> lock(mutex_);
+    --in_flight_;
+    UpdateLimitLocked(rtt_us, dropped);
+  }
+  slot_freed_.notify_one();
+}
+
+int ConcurrencyLimiter::limit() {
+  LockGuard<boost::mutex> lock(mutex_);
+  return static_cast<int>(limit_);
+}
+
+int ConcurrencyLimiter::in_flight() {
+  LockGuard<boost::mutex> lock(mutex_);
+  return in_flight_;
+}
+
+void ConcurrencyLimiter::UpdateLimitLocked(int64_t rtt_us, bool dropped) {
+  double new_limit;
+  if (dropped) {
+    new_limit = limit_ * kBackoffRatio;
+  } else if (rtt_us > 0) {
+    if (long_rtt_us_ == 0)
+      long_rtt_us_ = rtt_us;
+    else
+      long_rtt_us_ += (rtt_us - long_rtt_us_) * kLongRttWeight;
+    // Only grow when the limit is actually being used, otherwise an idle
+    // host would drift to max_limit_.
+    if (rtt_us < long_rtt_us_ && in_flight_ + 1 < limit_ / 2)
+      return;
+    double gradient = std::max(0.5, std::min(1.0, long_rtt_us_ / rtt_us));
+    new_limit = limit_ * gradient + sqrt(limit_);
+    new_limit = limit_ * (1 - kSmoothing) + new_limit * kSmoothing;
+  } else {
+    return;
+  }
+  limit_ = std::max<double>(min_limit_, std::min<double>(max_limit_,
+                                                         new_limit));
+}
@@ -0,0 +1,45 @@
+#ifndef CONCURRENCY_LIMITER_H_
+#define CONCURRENCY_LIMITER_H_
+
+#include <stdint.h>
+
+#include "thirdparty/boost/thread.hpp"
+
+// Adaptive cap on the requests in flight to one Cassandra host, in the
+// style of the gradient algorithm: the limit follows the ratio between the
+// long-term and the latest RTT, so it shrinks as soon as queueing shows up
+// on the host and grows back by about sqrt(limit) when latency is flat.
+// Timeouts and broken connections cut the limit multiplicatively.
+class ConcurrencyLimiter {
+ public:
+  ConcurrencyLimiter(int initial_limit, int min_limit, int max_limit,
+                     int max_queued);
+
+  // Takes an in-flight slot, waiting for one until |deadline_ms| (0 means
+  // no deadline). Returns false once the deadline passes, and false
+  // without waiting when |max_queued| callers are waiting already; only
+  // the latter sets |*shed| to true.
+  bool Acquire(int64_t deadline_ms, bool* shed = NULL);
+  // Frees a slot taken by Acquire. |rtt_us| is the observed round trip, or
+  // 0 if no request completed; |dropped| marks a timeout or broken
+  // connection.
+  void Release(int64_t rtt_us, bool dropped);
+
+  int limit();
+  int in_flight();
+
+ private:
+  void UpdateLimitLocked(int64_t rtt_us, bool dropped);
+
+  double limit_;
+  int min_limit_;
+  int max_limit_;
+  int max_queued_;
+  int in_flight_;
+  int waiting_;
+  double long_rtt_us_;  // slow moving average, 0 until the first sample
+  boost::mutex mutex_;
+  boost::condition_variable slot_freed_;
+};
+
+#endif // CONCURRENCY_LIMITER_H_
@@ -0,0 +1,74 @@
+#include "concurrency_limiter.h"
+
+#include "common/base/timestamp.h"
+#include "thirdparty/gtest/gtest.h"
+
+TEST(ConcurrencyLimiterTest, AcquiresUpToLimit) {
+  ConcurrencyLimiter limiter(2, 1, 10, 0);
+  EXPECT_TRUE(limiter.Acquire(0));
+  EXPECT_TRUE(limiter.Acquire(0));
+  EXPECT_EQ(2, limiter.in_flight());
+  limiter.Release(0, false);
+  EXPECT_EQ(1, limiter.in_flight());
+  EXPECT_TRUE(limiter.Acquire(0));
+}
+
+TEST(ConcurrencyLimiterTest, ShedsWhenQueueIsFull) {
+  ConcurrencyLimiter limiter(1, 1, 10, 0);
+  ASSERT_TRUE(limiter.Acquire(0));
+  bool shed = false;
+  EXPECT_FALSE(limiter.Acquire(GetTimeStampInMs() + 1000, &shed));
+  EXPECT_TRUE(shed);
+}
+
+TEST(ConcurrencyLimiterTest, DeadlineInQueueIsNotShed) {
+  ConcurrencyLimiter limiter(1, 1, 10, 4);
+  ASSERT_TRUE(limiter.Acquire(0));
+  bool shed = false;
+  int64_t start = GetTimeStampInMs();
+  EXPECT_FALSE(limiter.Acquire(start + 50, &shed));
+  EXPECT_FALSE(shed);
+  EXPECT_GE(GetTimeStampInMs(), start + 50);
+}
+
+TEST(ConcurrencyLimiterTest, WaiterGetsReleasedSlot) {
+  ConcurrencyLimiter limiter(1, 1, 10, 4);
+  ASSERT_TRUE(limiter.Acquire(0));
+  bool acquired = false;
+  boost::thread waiter([&]() {
+    acquired = limiter.Acquire(GetTimeStampInMs() + 10000);
+  });
+  boost::this_thread::sleep_for(boost::chrono::milliseconds(20));
+  limiter.Release(1000, false);
+  waiter.join();
+  EXPECT_TRUE(acquired);
+  EXPECT_EQ(1, limiter.in_flight());
+}
+
+TEST(ConcurrencyLimiterTest, DropsCutTheLimit) {
+  ConcurrencyLimiter limiter(100, 10, 200, 0);
+  for (int i = 0; i < 10; ++i) {
+    ASSERT_TRUE(limiter.Acquire(0));
+    limiter.Release(0, true);
+  }
+  EXPECT_LT(limiter.limit(), 100);
+  for (int i = 0; i < 100; ++i) {
+    ASSERT_TRUE(limiter.Acquire(0));
+    limiter.Release(0, true);
+  }
+  EXPECT_EQ(10, limiter.limit());
+}
+
+TEST(ConcurrencyLimiterTest, RisingLatencyShrinksTheLimit) {
+  ConcurrencyLimiter limiter(50, 1, 100, 0);
+  for (int i = 0; i < 50; ++i)
+    ASSERT_TRUE(limiter.Acquire(0));
+  for (int i = 0; i < 50; ++i)
+    limiter.Release(1000, false);
+  int flat = limiter.limit();
+  for (int i = 0; i < 50; ++i)
+    ASSERT_TRUE(limiter.Acquire(0));
+  for (int i = 0; i < 50; ++i)
+    limiter.Release(10000, false);
+  EXPECT_LT(limiter.limit(), flat);
+}
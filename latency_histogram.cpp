@@ -0,0 +1,131 @@
+#include "latency_histogram.h"
+
+#include <string.h>
+
+#include <algorithm>
+#include <limits>
+
+namespace {
+
+const size_t kLinearBuckets = 64;
+const size_t kSubBuckets = 32;
+// Enough for INT64_MAX, whose highest bit is bit 62.
+const size_t kNumBuckets = kLinearBuckets + (62 - 5) * kSubBuckets;
+
+void AppendUint64(uint64_t value, std::string* out) {
+  for (int i = 0; i < 8; ++i)
+    out->push_back(static_cast<char>(value >> (8 * i)));
+}
+
+bool ReadUint64(const char** pos, const char* end, uint64_t* value) {
+  if (end - *pos < 8)
+    return false;
+  *value = 0;
+  for (int i = 0; i < 8; ++i)
+    *value |= static_cast<uint64_t>(static_cast<unsigned char>((*pos)[i]))
+        << (8 * i);
+  *pos += 8;
+  return true;
+}
+
+}  // namespace
+
+LatencyHistogram::LatencyHistogram()
+    : buckets_(kNumBuckets, 0), count_(0),
+      min_(std::numeric_limits<int64_t>::max()), max_(0), sum_(0) {
+}
+
+size_t LatencyHistogram::BucketOf(int64_t latency_us) {
+  if (latency_us < static_cast<int64_t>(kLinearBuckets))
+    return latency_us < 0 ? 0 : latency_us;
+  int shift = 63 - __builtin_clzll(latency_us) - 5;
+  size_t sub = latency_us >> shift;
+  return kLinearBuckets + (shift - 1) * kSubBuckets + (sub - kSubBuckets);
+}
+
+// Upper bound of |bucket|.
+int64_t LatencyHistogram::BucketValue(size_t bucket) {
+  if (bucket < kLinearBuckets)
+    return bucket;
+  int shift = (bucket - kLinearBuckets) / kSubBuckets + 1;
+  int64_t sub = (bucket - kLinearBuckets) % kSubBuckets + kSubBuckets;
+  return (sub << shift) + ((static_cast<int64_t>(1) << shift) - 1);
+}
+
+void LatencyHistogram::Record(int64_t latency_us) {
+  if (latency_us < 0)
+    latency_us = 0;
+  ++buckets_[BucketOf(latency_us)];
+  ++count_;
+  min_ = std::min(min_, latency_us);
+  max_ = std::max(max_, latency_us);
+  sum_ += latency_us;
+}
+
+void LatencyHistogram::Merge(LatencyHistogram const& other) {
+  for (size_t i = 0; i < kNumBuckets; ++i)
+    buckets_[i] += other.buckets_[i];
+  count_ += other.count_;
+  min_ = std::min(min_, other.min_);
+  max_ = std::max(max_, other.max_);
+  sum_ += other.sum_;
+}
+
+double LatencyHistogram::Mean() const {
+  return count_ ? sum_ / count_ : 0;
+}
+
+int64_t LatencyHistogram::Percentile(double rank) const {
+  if (count_ == 0)
+    return 0;
+  uint64_t target = std::max<uint64_t>(rank * count_, 1);
+  uint64_t seen = 0;
+  for (size_t i = 0; i < kNumBuckets; ++i) {
+    seen += buckets_[i];
+    if (seen >= target)
+      return std::min(std::max(BucketValue(i), min_), max_);
+  }
+  return max_;
+}
+
+// Layout, all little-endian uint64: min, max, sum (IEEE 754 bits), then a
+// (bucket, count) pair per non-empty bucket.
+void LatencyHistogram::Serialize(std::string* out) const {
+  out->clear();
+  uint64_t sum_bits;
+  memcpy(&sum_bits, &sum_, sizeof(sum_bits));
+  AppendUint64(min_, out);
+  AppendUint64(max_, out);
+  AppendUint64(sum_bits, out);
+  for (size_t i = 0; i < kNumBuckets; ++i) {
+    if (buckets_[i] == 0)
+      continue;
+    AppendUint64(i, out);
+    AppendUint64(buckets_[i], out);
+  }
+}
+
+bool LatencyHistogram::Parse(const char* data, size_t size) {
+  const char* pos = data;
+  const char* end = data + size;
+  uint64_t min, max, sum_bits;
+  if (!ReadUint64(&pos, end, &min) || !ReadUint64(&pos, end, &max) ||
+      !ReadUint64(&pos, end, &sum_bits))
+    return false;
+  std::vector<uint64_t> buckets(kNumBuckets, 0);
+  uint64_t count = 0;
+  while (pos < end) {
+    uint64_t bucket, bucket_count;
+    if (!ReadUint64(&pos, end, &bucket) ||
+        !ReadUint64(&pos, end, &bucket_count) || bucket >= kNumBuckets)
+      return false;
+    buckets[bucket] += bucket_count;
+    count += bucket_count;
+  }
+  buckets_.swap(buckets);
+  count_ = count;
+  min_ = min;
+  max_ = max;
+  memcpy(&sum_, &sum_bits, sizeof(sum_));
+  return true;
+}
@@ -0,0 +1,46 @@
+#ifndef LATENCY_HISTOGRAM_H_
+#define LATENCY_HISTOGRAM_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <string>
+#include <vector>
+
+// Log-linear histogram of latencies in microseconds: exact below 64us,
+// then 32 buckets per power of two, so any percentile is within about 3%
+// of the recorded value. Histograms of separate threads or processes can
+// be merged without losing precision, unlike their percentiles. Not
+// thread-safe.
+class LatencyHistogram {
+ public:
+  LatencyHistogram();
+
+  void Record(int64_t latency_us);
+  void Merge(LatencyHistogram const& other);
+
+  uint64_t count() const { return count_; }
+  int64_t min() const { return count_ ? min_ : 0; }
+  int64_t max() const { return max_; }
+  double Mean() const;
+  // Latency below which |rank| (0 to 1) of the samples fall.
+  int64_t Percentile(double rank) const;
+
+  // Sparse encoding of the non-empty buckets for sending the histogram to
+  // another process.
+  void Serialize(std::string* out) const;
+  // Returns false if [data, data + size) is not a serialized histogram.
+  bool Parse(const char* data, size_t size);
+
+ private:
+  static size_t BucketOf(int64_t latency_us);
+  static int64_t BucketValue(size_t bucket);
+
+  std::vector<uint64_t> buckets_;
+  uint64_t count_;
+  int64_t min_;
+  int64_t max_;
+  double sum_;
+};
+
+#endif // LATENCY_HISTOGRAM_H_
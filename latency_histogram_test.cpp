@@ -0,0 +1,91 @@
+#include "latency_histogram.h"
+
+#include <string>
+
+#include "thirdparty/gtest/gtest.h"
+
+TEST(LatencyHistogramTest, EmptyHistogram) {
+  LatencyHistogram histogram;
+  EXPECT_EQ(0u, histogram.count());
+  EXPECT_EQ(0, histogram.min());
+  EXPECT_EQ(0, histogram.max());
+  EXPECT_EQ(0, histogram.Mean());
+  EXPECT_EQ(0, histogram.Percentile(0.99));
+}
+
+TEST(LatencyHistogramTest, ExactBelowLinearRange) {
+  LatencyHistogram histogram;
+  for (int i = 1; i <= 50; ++i)
+    histogram.Record(i);
+  EXPECT_EQ(50u, histogram.count());
+  EXPECT_EQ(1, histogram.min());
+  EXPECT_EQ(50, histogram.max());
+  EXPECT_DOUBLE_EQ(25.5, histogram.Mean());
+  EXPECT_EQ(25, histogram.Percentile(0.5));
+  EXPECT_EQ(50, histogram.Percentile(1));
+}
+
+TEST(LatencyHistogramTest, PercentilesWithinBucketError) {
+  LatencyHistogram histogram;
+  for (int64_t i = 1; i <= 100000; ++i)
+    histogram.Record(i * 10);
+  double ranks[] = { 0.5, 0.9, 0.99, 0.999 };
+  for (size_t i = 0; i < sizeof(ranks) / sizeof(ranks[0]); ++i) {
+    double exact = ranks[i] * 1000000;
+    double reported = histogram.Percentile(ranks[i]);
+    EXPECT_NEAR(exact, reported, exact * 0.035) << "rank " << ranks[i];
+  }
+}
+
+TEST(LatencyHistogramTest, NegativeLatencyCountsAsZero) {
+  LatencyHistogram histogram;
+  histogram.Record(-5);
+  EXPECT_EQ(0, histogram.min());
+  EXPECT_EQ(0, histogram.Percentile(1));
+}
+
+TEST(LatencyHistogramTest, MergeMatchesSingleHistogram) {
+  LatencyHistogram all, even, odd;
+  for (int64_t i = 0; i < 10000; ++i) {
+    all.Record(i * 7);
+    (i % 2 ? odd : even).Record(i * 7);
+  }
+  even.Merge(odd);
+  EXPECT_EQ(all.count(), even.count());
+  EXPECT_EQ(all.min(), even.min());
+  EXPECT_EQ(all.max(), even.max());
+  EXPECT_DOUBLE_EQ(all.Mean(), even.Mean());
+  EXPECT_EQ(all.Percentile(0.99), even.Percentile(0.99));
+}
+
+TEST(LatencyHistogramTest, SerializeRoundTrip) {
+  LatencyHistogram histogram;
+  histogram.Record(3);
+  histogram.Record(12345);
+  histogram.Record(INT64_MAX);
+  std::string data;
+  histogram.Serialize(&data);
+
+  LatencyHistogram parsed;
+  ASSERT_TRUE(parsed.Parse(data.data(), data.size()));
+  EXPECT_EQ(histogram.count(), parsed.count());
+  EXPECT_EQ(histogram.min(), parsed.min());
+  EXPECT_EQ(histogram.max(), parsed.max());
+  EXPECT_DOUBLE_EQ(histogram.Mean(), parsed.Mean());
+  EXPECT_EQ(histogram.Percentile(0.5), parsed.Percentile(0.5));
+}
+
+TEST(LatencyHistogramTest, ParseRejectsTruncatedAndBadBuckets) {
+  LatencyHistogram histogram;
+  histogram.Record(100);
+  std::string data;
+  histogram.Serialize(&data);
+
+  LatencyHistogram parsed;
+  EXPECT_FALSE(parsed.Parse(data.data(), data.size() - 1));
+  EXPECT_FALSE(parsed.Parse(data.data(), 16));
+  // Bucket index far beyond the last bucket.
+  data[24 + 7] = '\x7f';
+  EXPECT_FALSE(parsed.Parse(data.data(), data.size()));
+  EXPECT_EQ(0u, parsed.count());
+}
@@ -0,0 +1,152 @@
+#include "mailbox_cache.h"
+
+#include <string.h>
+
+#include <functional>
+#include <utility>
+
+#include "common/base/timestamp.h"
+#include "lock_guard.h"
+
+namespace {
+
+// Rough per-entry bookkeeping cost: list node, hash node, key string and
+// the batch's two containers.
+const size_t kEntryOverhead = 128;
+
+}  // namespace
+
+MailboxCache::MailboxCache(size_t num_shards, size_t capacity_bytes,
+                           int ttl_ms)
+    : shard_capacity_(capacity_bytes / (num_shards ? num_shards : 1)),
+      ttl_ms_(ttl_ms), hits_(0), misses_(0), evictions_(0), expirations_(0) {
+  if (num_shards == 0)
+    num_shards = 1;
+  for (size_t i = 0; i < num_shards; ++i) {
+    boost::shared_ptr<Shard> shard(new Shard);
+    shard->bytes = 0;
+    memset(shard->generations, 0, sizeof(shard->generations));
+    shards_.push_back(shard);
+  }
+}
+
+bool MailboxCache::Lookup(std::string const& receiver,
+                          std::vector<Message>* msgs, uint64_t* fill_token) {
+  size_t generation;
+  Shard* shard = GetShard(receiver, &generation);
+  LockGuard<boost::mutex> lock(shard->mutex);
+  *fill_token = shard->generations[generation];
+  auto found = shard->index.find(receiver);
+  if (found == shard->index.end()) {
+    std::atomic_fetch_add(&misses_, static_cast<uint64_t>(1));
+    return false;
+  }
+  EntryList::iterator it = found->second;
+  if (it->expire_time <= GetTimeStampInMs()) {
+    EraseLocked(shard, it);
+    std::atomic_fetch_add(&expirations_, static_cast<uint64_t>(1));
+    std::atomic_fetch_add(&misses_, static_cast<uint64_t>(1));
+    return false;
+  }
+  shard->lru.splice(shard->lru.begin(), shard->lru, it);
+  it->messages.AppendTo(msgs);
+  std::atomic_fetch_add(&hits_, static_cast<uint64_t>(1));
+  return true;
+}
+
+void MailboxCache::Insert(std::string const& receiver,
+                          PackedMessageBatch const& msgs,
+                          uint64_t fill_token) {
+  Entry entry;
+  entry.receiver = receiver;
+  entry.expire_time = GetTimeStampInMs() + ttl_ms_;
+  entry.messages = msgs;
+  if (Charge(entry) > shard_capacity_)
+    return;
+
+  size_t generation;
+  Shard* shard = GetShard(receiver, &generation);
+  LockGuard<boost::mutex> lock(shard->mutex);
+  if (shard->generations[generation] != fill_token)
+    return;
+  auto found = shard->index.find(receiver);
+  if (found != shard->index.end())
+    EraseLocked(shard, found->second);
+  shard->lru.push_front(std::move(entry));
+  shard->index[receiver] = shard->lru.begin();
+  shard->bytes += Charge(shard->lru.front());
+  EvictLocked(shard);
+}
+
+void MailboxCache::Append(const Message& message) {
+  size_t generation;
+  Shard* shard = GetShard(message.receiver_id, &generation);
+  LockGuard<boost::mutex> lock(shard->mutex);
+  ++shard->generations[generation];
+  auto found = shard->index.find(message.receiver_id);
+  if (found == shard->index.end())
+    return;
+  Entry& entry = *found->second;
+  // Mailboxes are kept in the (ts, msg_id) order of the table. A message
+  // that does not sort last is an upsert of a cached row or arrived out of
+  // order; either needs a change in the middle of the packed batch, so the
+  // mailbox is fetched again instead.
+  size_t old_charge = Charge(entry);
+  if ((!entry.messages.empty() &&
+       entry.messages.CompareKey(entry.messages.size() - 1,
+                                 message.timestamp, message.msg_id) >= 0) ||
+      !entry.messages.Append(message)) {
+    EraseLocked(shard, found->second);
+    return;
+  }
+  shard->bytes += Charge(entry) - old_charge;
+  EvictLocked(shard);
+}
+
+void MailboxCache::Invalidate(std::string const& receiver) {
+  size_t generation;
+  Shard* shard = GetShard(receiver, &generation);
+  LockGuard<boost::mutex> lock(shard->mutex);
+  ++shard->generations[generation];
+  auto found = shard->index.find(receiver);
+  if (found != shard->index.end())
+    EraseLocked(shard, found->second);
+}
+
+void MailboxCache::GetStats(Stats* stats) {
+  stats->hits = hits_.load();
+  stats->misses = misses_.load();
+  stats->evictions = evictions_.load();
+  stats->expirations = expirations_.load();
+  stats->entries = 0;
+  stats->bytes = 0;
+  for (size_t i = 0; i < shards_.size(); ++i) {
+    LockGuard<boost::mutex> lock(shards_[i]->mutex);
+    stats->entries += shards_[i]->index.size();
+    stats->bytes += shards_[i]->bytes;
+  }
+}
+
+MailboxCache::Shard* MailboxCache::GetShard(std::string const& receiver,
+                                            size_t* generation) {
+  size_t hash = std::hash<std::string>()(receiver);
+  *generation = hash / shards_.size() % kGenerations;
+  return shards_[hash % shards_.size()].get();
+}
+
+void MailboxCache::EraseLocked(Shard* shard, EntryList::iterator it) {
+  shard->bytes -= Charge(*it);
+  shard->index.erase(it->receiver);
+  shard->lru.erase(it);
+}
+
+void MailboxCache::EvictLocked(Shard* shard) {
+  while (shard->bytes > shard_capacity_ && !shard->lru.empty()) {
+    EraseLocked(shard, --shard->lru.end());
+    std::atomic_fetch_add(&evictions_, static_cast<uint64_t>(1));
+  }
+}
+
+size_t MailboxCache::Charge(Entry const& entry) {
+  return kEntryOverhead + entry.receiver.size() + entry.messages.ByteSize();
+}
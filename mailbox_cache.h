@@ -0,0 +1,85 @@
+#ifndef MAILBOX_CACHE_H_
+#define MAILBOX_CACHE_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <atomic>
+#include <list>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "common/idl/message_types.h"
+#include "packed_message.h"
+#include "thirdparty/boost/thread.hpp"
+
+// Sharded LRU cache of offline mailboxes keyed by receiver_id. Each
+// mailbox is kept as a PackedMessageBatch, is charged its size against a
+// byte budget and expires after a TTL.
+class MailboxCache {
+ public:
+  struct Stats {
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t evictions;    // entries dropped to stay within the budget
+    uint64_t expirations;  // entries dropped because the TTL passed
+    uint64_t entries;
+    uint64_t bytes;
+  };
+
+  MailboxCache(size_t num_shards, size_t capacity_bytes, int ttl_ms);
+
+  // On a miss |*fill_token| is set to what Insert needs for the mailbox
+  // fetched afterwards.
+  bool Lookup(std::string const& receiver, std::vector<Message>* msgs,
+              uint64_t* fill_token);
+  // Caches the mailbox fetched after the Lookup that returned |fill_token|,
+  // unless an Append or Invalidate for |receiver| came in between: the
+  // fetch may then predate that write.
+  void Insert(std::string const& receiver, PackedMessageBatch const& msgs,
+              uint64_t fill_token);
+  // Adds |message|, which must already be written to Cassandra, to the
+  // mailbox of its receiver if that mailbox is cached, so a Retrieve after
+  // Store in this process sees it. A message that does not sort after the
+  // cached ones by (ts, msg_id), e.g. an upsert of one of them, or that is
+  // too large for the packed format, drops the mailbox instead.
+  void Append(const Message& message);
+  void Invalidate(std::string const& receiver);
+  void GetStats(Stats* stats);
+
+ private:
+  struct Entry {
+    std::string receiver;
+    PackedMessageBatch messages;
+    int64_t expire_time;  // ms
+  };
+  typedef std::list<Entry> EntryList;
+  // Receivers share write generations by hash, so the fill tokens of
+  // uncached mailboxes take no memory per receiver. A write to one only
+  // costs the others a skipped fill.
+  static const size_t kGenerations = 64;
+  struct Shard {
+    boost::mutex mutex;
+    EntryList lru;  // most recently used first
+    std::unordered_map<std::string, EntryList::iterator> index;
+    size_t bytes;
+    uint64_t generations[kGenerations];  // bumped by Append and Invalidate
+  };
+
+  // Sets |*generation| to the slot of |receiver| in the returned shard.
+  Shard* GetShard(std::string const& receiver, size_t* generation);
+  void EraseLocked(Shard* shard, EntryList::iterator it);
+  void EvictLocked(Shard* shard);
+  static size_t Charge(Entry const& entry);
+
+  std::vector<boost::shared_ptr<Shard>> shards_;
+  size_t shard_capacity_;
+  int ttl_ms_;
+  std::atomic<uint64_t> hits_;
+  std::atomic<uint64_t> misses_;
+  std::atomic<uint64_t> evictions_;
+  std::atomic<uint64_t> expirations_;
+};
+
+#endif // MAILBOX_CACHE_H_
@@ -0,0 +1,153 @@
+#include "mailbox_cache.h"
+
+#include <string>
+#include <vector>
+
+#include "test_message.h"
+#include "thirdparty/gtest/gtest.h"
+
+namespace {
+
+PackedMessageBatch MakeBatch(std::string const& receiver, int count) {
+  PackedMessageBatch batch;
+  for (int i = 0; i < count; ++i)
+    batch.Append(MakeTestMessage(receiver, i));
+  return batch;
+}
+
+}  // namespace
+
+TEST(MailboxCacheTest, MissThenFillThenHit) {
+  MailboxCache cache(4, 1 << 20, 60000);
+  std::vector<Message> msgs;
+  uint64_t token;
+  EXPECT_FALSE(cache.Lookup("alice", &msgs, &token));
+  cache.Insert("alice", MakeBatch("alice", 3), token);
+
+  EXPECT_TRUE(cache.Lookup("alice", &msgs, &token));
+  ASSERT_EQ(3u, msgs.size());
+  EXPECT_EQ("2", msgs[2].msg_id);
+
+  MailboxCache::Stats stats;
+  cache.GetStats(&stats);
+  EXPECT_EQ(1u, stats.hits);
+  EXPECT_EQ(1u, stats.misses);
+  EXPECT_EQ(1u, stats.entries);
+}
+
+TEST(MailboxCacheTest, StoreDuringFillSkipsTheFill) {
+  MailboxCache cache(4, 1 << 20, 60000);
+  std::vector<Message> msgs;
+  uint64_t token;
+  EXPECT_FALSE(cache.Lookup("alice", &msgs, &token));
+  // A store lands between the Retrieve's query and its Insert, so the
+  // fetched mailbox may lack the new message.
+  cache.Append(MakeTestMessage("alice", 5));
+  cache.Insert("alice", MakeBatch("alice", 3), token);
+  EXPECT_FALSE(cache.Lookup("alice", &msgs, &token));
+
+  // The next fill is not raced and sticks.
+  cache.Insert("alice", MakeBatch("alice", 4), token);
+  EXPECT_TRUE(cache.Lookup("alice", &msgs, &token));
+  EXPECT_EQ(4u, msgs.size());
+}
+
+TEST(MailboxCacheTest, InvalidateDuringFillSkipsTheFill) {
+  MailboxCache cache(4, 1 << 20, 60000);
+  std::vector<Message> msgs;
+  uint64_t token;
+  EXPECT_FALSE(cache.Lookup("alice", &msgs, &token));
+  cache.Invalidate("alice");
+  cache.Insert("alice", MakeBatch("alice", 3), token);
+  EXPECT_FALSE(cache.Lookup("alice", &msgs, &token));
+}
+
+TEST(MailboxCacheTest, AppendExtendsCachedMailbox) {
+  MailboxCache cache(4, 1 << 20, 60000);
+  std::vector<Message> msgs;
+  uint64_t token;
+  cache.Lookup("alice", &msgs, &token);
+  cache.Insert("alice", MakeBatch("alice", 2), token);
+  cache.Append(MakeTestMessage("alice", 9));
+
+  msgs.clear();
+  ASSERT_TRUE(cache.Lookup("alice", &msgs, &token));
+  ASSERT_EQ(3u, msgs.size());
+  EXPECT_EQ("9", msgs[2].msg_id);
+}
+
+TEST(MailboxCacheTest, AppendOfCachedMsgIdDropsMailbox) {
+  MailboxCache cache(4, 1 << 20, 60000);
+  std::vector<Message> msgs;
+  uint64_t token;
+  cache.Lookup("alice", &msgs, &token);
+  cache.Insert("alice", MakeBatch("alice", 2), token);
+  // An upsert of message 1, which the cached copy can not reflect.
+  Message upsert = MakeTestMessage("alice", 1);
+  upsert.__set_msg("edited");
+  cache.Append(upsert);
+  EXPECT_FALSE(cache.Lookup("alice", &msgs, &token));
+}
+
+TEST(MailboxCacheTest, OutOfOrderAppendDropsMailbox) {
+  MailboxCache cache(4, 1 << 20, 60000);
+  std::vector<Message> msgs;
+  uint64_t token;
+  cache.Lookup("alice", &msgs, &token);
+  cache.Insert("alice", MakeBatch("alice", 2), token);
+  // Sorts between the cached messages 0 and 1.
+  Message message = MakeTestMessage("alice", 0);
+  message.__set_msg_id("00");
+  cache.Append(message);
+  EXPECT_FALSE(cache.Lookup("alice", &msgs, &token));
+}
+
+TEST(MailboxCacheTest, OversizedAppendDropsMailbox) {
+  MailboxCache cache(1, 1 << 20, 60000);
+  std::vector<Message> msgs;
+  uint64_t token;
+  cache.Lookup("alice", &msgs, &token);
+  cache.Insert("alice", MakeBatch("alice", 2), token);
+  Message message = MakeTestMessage("alice", 3);
+  message.__set_sender_id(std::string(70000, 's'));
+  cache.Append(message);
+  EXPECT_FALSE(cache.Lookup("alice", &msgs, &token));
+}
+
+TEST(MailboxCacheTest, EvictsLeastRecentlyUsed) {
+  PackedMessageBatch batch = MakeBatch("x", 10);
+  // Room for about two mailboxes in the single shard.
+  MailboxCache cache(1, 2 * (batch.ByteSize() + 200), 60000);
+  std::vector<Message> msgs;
+  uint64_t token;
+  const char* receivers[] = { "a", "b", "c" };
+  for (int i = 0; i < 3; ++i) {
+    cache.Lookup(receivers[i], &msgs, &token);
+    cache.Insert(receivers[i], MakeBatch(receivers[i], 10), token);
+    if (i == 1)
+      cache.Lookup("a", &msgs, &token);  // a becomes most recent
+  }
+  EXPECT_TRUE(cache.Lookup("a", &msgs, &token));
+  EXPECT_FALSE(cache.Lookup("b", &msgs, &token));
+  EXPECT_TRUE(cache.Lookup("c", &msgs, &token));
+
+  MailboxCache::Stats stats;
+  cache.GetStats(&stats);
+  EXPECT_EQ(1u, stats.evictions);
+  EXPECT_EQ(2u, stats.entries);
+}
+
+TEST(MailboxCacheTest, ExpiresAfterTtl) {
+  MailboxCache cache(1, 1 << 20, 10);
+  std::vector<Message> msgs;
+  uint64_t token;
+  cache.Lookup("alice", &msgs, &token);
+  cache.Insert("alice", MakeBatch("alice", 1), token);
+  boost::this_thread::sleep_for(boost::chrono::milliseconds(30));
+  EXPECT_FALSE(cache.Lookup("alice", &msgs, &token));
+
+  MailboxCache::Stats stats;
+  cache.GetStats(&stats);
+  EXPECT_EQ(1u, stats.expirations);
+  EXPECT_EQ(0u, stats.entries);
+}
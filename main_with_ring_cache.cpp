@@ -8,7 +8,10 @@
 #include "common/base/functor.h"
 #include "common/base/join_functor.h"
 #include "common/base/timestamp.h"
+#include "query_compressor.h"
 #include "random_message.h"
+#include "stress_coordinator.h"
+#include "thirdparty/boost/thread/future.hpp"
 #include "thirdparty/boost/thread/thread.hpp"
 #include "thirdparty/gflags/gflags.h"
 #include "thirdparty/glog/logging.h"
@@ -17,8 +20,11 @@ DEFINE_int32(thread_count, 1, "Number of client threads");
 DEFINE_int32(operation_count, 10000, "Count of operations");
 DEFINE_string(operation_type, "INSERT",
              "Type of operation--INSERT, SELECT");
+DEFINE_int32(drain_timeout_ms, 20000,
+             "Time allowed for outstanding requests at shutdown");
 
 std::atomic<size_t> hit_count(0);
+std::atomic<size_t> success_count(0);
 
 double RankLatency(double rank, double* arr, size_t size) {
   size_t index = rank * size;
@@ -34,8 +40,10 @@ void Store(OfflineManager* offline_manager, size_t loop_count,
   for (size_t i = 0; i < loop_count; ++i) {
     RandomMessage::GenerateMessage(&message);
     int64_t start_time = GetTimeStampInUs();
-    auto store_cb = [=](bool success) {
+    auto store_cb = [=](OfflineStatus::type status) {
       int64_t end_time = GetTimeStampInUs();
+      if (status == OfflineStatus::OK)
+        std::atomic_fetch_add(&success_count, static_cast<size_t>(1));
       double latency = (end_time - start_time) / 1000.0;
       latency_arr[i] = latency;
       joiner->Run();
@@ -51,9 +59,12 @@ void Retrieve(OfflineManager* offline_manager, size_t loop_count,
     std::string receiver;
     RandomMessage::GenerateString(&receiver);
     int64_t start_time = GetTimeStampInUs();
-    auto retrieve_cb = [=](std::vector<Message> const& msgs) {
+    auto retrieve_cb = [=](OfflineStatus::type status,
+                           std::vector<Message> const& msgs) {
       int64_t end_time = GetTimeStampInUs();
-      if (msgs.size())
+      if (status == OfflineStatus::OK)
+        std::atomic_fetch_add(&success_count, static_cast<size_t>(1));
+      if (status == OfflineStatus::OK && msgs.size())
         std::atomic_fetch_add(&hit_count,static_cast<size_t>(1));
       double latency = (end_time - start_time) / 1000.0;
       latency_arr[i] = latency;
@@ -66,9 +77,14 @@ void Retrieve(OfflineManager* offline_manager, size_t loop_count,
 int main(int argc, char** argv) {
   google::InitGoogleLogging(argv[0]);
   google::ParseCommandLineFlags(&argc, &argv, false);
+  if (StressCoordinator::Enabled()) {
+    StressCoordinator coordinator;
+    return coordinator.Run(argv) ? 0 : 1;
+  }
 
   OfflineManager* offline_manager = &OfflineManager::GetInstance();
-  boost::this_thread::sleep_for(boost::chrono::seconds(10));
+  if (!offline_manager->WaitUntilReady(10000))
+    LOG(WARNING) << "Not every token range has a live replica yet";
 
   size_t loop_count = FLAGS_operation_count / FLAGS_thread_count;
   std::vector<boost::thread*> threads;
@@ -77,6 +93,14 @@ int main(int argc, char** argv) {
     double* latency = new double[loop_count];
     latencies.push_back(latency);
   }
+  // The report is sent from the last callback, which may still run after
+  // main returns if the drain times out, so it shares the worker.
+  boost::shared_ptr<StressWorker> worker(new StressWorker);
+  if (StressWorker::Enabled() && !worker->WaitForStart())
+    return 1;
+  boost::shared_ptr<boost::promise<void>> reported(
+      new boost::promise<void>);
+  boost::unique_future<void> finished = reported->get_future();
 
   int64_t stress_begin_time = GetTimeStampInMs();
   auto joiner = NewFunctor([=]() {
@@ -92,6 +116,7 @@ int main(int argc, char** argv) {
     std::sort(latency_result, latency_result + FLAGS_operation_count);
     LOG(INFO) << "Operation type: " << FLAGS_operation_type;
     LOG(INFO) << "Operation count: " << FLAGS_operation_count;
+    LOG(INFO) << "Success count: " << success_count;
     LOG(INFO) << "Hit count: " << hit_count;
     LOG(INFO) << "Thread count: " << FLAGS_thread_count;
     LOG(INFO) << "QPS: "
@@ -110,9 +135,43 @@ int main(int argc, char** argv) {
     LOG(INFO) << ".999 latency: "
               << RankLatency(0.999, latency_result, FLAGS_operation_count)
               << " ms";
+    CompressionStats compression_stats;
+    GetCompressionStats(&compression_stats);
+    LOG(INFO) << "Compressed queries: " << compression_stats.compressed_count
+              << ", uncompressed: " << compression_stats.skipped_count;
+    LOG(INFO) << "Query bytes: " << compression_stats.raw_bytes
+              << ", on the wire: " << compression_stats.wire_bytes;
+    LOG(INFO) << "Compression CPU: "
+              << compression_stats.compress_time_us / 1000.0 << " ms";
+    MailboxCache::Stats cache_stats;
+    if (offline_manager->GetCacheStats(&cache_stats)) {
+      LOG(INFO) << "Mailbox cache hits: " << cache_stats.hits
+                << ", misses: " << cache_stats.misses
+                << ", evictions: " << cache_stats.evictions
+                << ", expirations: " << cache_stats.expirations;
+      LOG(INFO) << "Mailbox cache entries: " << cache_stats.entries
+                << ", bytes: " << cache_stats.bytes;
+    }
+    CompletionExecutor::Stats completion_stats;
+    if (offline_manager->GetCompletionStats(&completion_stats)) {
+      LOG(INFO) << "Callbacks executed: " << completion_stats.executed
+                << ", stolen: " << completion_stats.stolen
+                << ", still queued: " << completion_stats.queue_depth;
+    }
+    if (StressWorker::Enabled()) {
+      StressReport report;
+      report.operations = FLAGS_operation_count;
+      report.successes = success_count;
+      report.elapsed_ms = stress_end_time - stress_begin_time;
+      for (int i = 0; i < FLAGS_operation_count; ++i)
+        report.latencies.Record(latency_result[i] * 1000);
+      if (!worker->SendReport(report))
+        LOG(ERROR) << "Failed to report to the stress coordinator";
+    }
     delete [] latency_result;
     for (int i = 0; i < latencies.size(); ++i)
       delete [] latencies[i];
+    reported->set_value();
   });
   Functor<void>* finish = new JoinFunctor(FLAGS_thread_count, joiner);
 
@@ -138,7 +197,11 @@ int main(int argc, char** argv) {
     delete threads[i];
   }
 
-  boost::this_thread::sleep_for(boost::chrono::seconds(20));
+  if (!offline_manager->Drain(FLAGS_drain_timeout_ms))
+    LOG(WARNING) << "Shut down with requests still in flight";
+  if (finished.wait_for(boost::chrono::milliseconds(
+          FLAGS_drain_timeout_ms)) != boost::future_status::ready)
+    LOG(WARNING) << "Exiting before the last request completed";
   return 0;
 }
 
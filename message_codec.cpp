@@ -0,0 +1,61 @@
+#include "message_codec.h"
+
+#include <stdint.h>
+
+namespace {
+
+void EncodeField(const std::string& field, std::string* out) {
+  uint32_t size = field.size();
+  char header[4];
+  for (int i = 0; i < 4; ++i)
+    header[i] = static_cast<char>((size >> (8 * i)) & 0xff);
+  out->append(header, 4);
+  out->append(field);
+}
+
+bool DecodeField(const char** pos, const char* end, std::string* field) {
+  if (end - *pos < 4)
+    return false;
+  const unsigned char* p = reinterpret_cast<const unsigned char*>(*pos);
+  uint32_t size = p[0] | (p[1] << 8) | (p[2] << 16) |
+                  (static_cast<uint32_t>(p[3]) << 24);
+  if (static_cast<uint32_t>(end - *pos - 4) < size)
+    return false;
+  field->assign(*pos + 4, size);
+  *pos += 4 + size;
+  return true;
+}
+
+}  // namespace
+
+void EncodeMessage(const Message& message, std::string* out) {
+  EncodeField(message.receiver_id, out);
+  EncodeField(message.timestamp, out);
+  EncodeField(message.msg_id, out);
+  EncodeField(message.group_id, out);
+  EncodeField(message.msg, out);
+  EncodeField(message.sender_id, out);
+}
+
+bool DecodeMessage(const char** pos, const char* end, Message* message) {
+  std::string field;
+  if (!DecodeField(pos, end, &field))
+    return false;
+  message->__set_receiver_id(field);
+  if (!DecodeField(pos, end, &field))
+    return false;
+  message->__set_timestamp(field);
+  if (!DecodeField(pos, end, &field))
+    return false;
+  message->__set_msg_id(field);
+  if (!DecodeField(pos, end, &field))
+    return false;
+  message->__set_group_id(field);
+  if (!DecodeField(pos, end, &field))
+    return false;
+  message->__set_msg(field);
+  if (!DecodeField(pos, end, &field))
+    return false;
+  message->__set_sender_id(field);
+  return true;
+}
@@ -0,0 +1,16 @@
+#ifndef MESSAGE_CODEC_H_
+#define MESSAGE_CODEC_H_
+
+#include <string>
+
+#include "common/idl/message_types.h"
+
+// Flat binary encoding of a Message: the six fields in declaration order,
+// each as a 4-byte little-endian length followed by the bytes.
+void EncodeMessage(const Message& message, std::string* out);
+
+// Decodes one message starting at |*pos| and advances |*pos| past it.
+// Returns false if [*pos, end) does not hold a complete message.
+bool DecodeMessage(const char** pos, const char* end, Message* message);
+
+#endif // MESSAGE_CODEC_H_
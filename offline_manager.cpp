@@ -1,76 +1,535 @@
 #include "offline_manager.h"
 
+#include <sched.h>
+
 #include "cass_client_pool.h"
+#include "common/base/timestamp.h"
+#include "lock_guard.h"
+#include "query_compressor.h"
 #include "thirdparty/cass/Cassandra.h"
 #include "thirdparty/glog/logging.h"
 
+DEFINE_int32(retrieve_page_size, 100,
+             "Default number of messages per page for RetrievePaged");
+DEFINE_int32(offline_request_timeout_ms, 3000,
+             "Deadline in ms applied to requests that do not carry one");
+DEFINE_string(store_consistency, "ONE", "Consistency level of Store");
+DEFINE_string(retrieve_consistency, "ONE",
+              "Consistency level of Retrieve and RetrievePaged");
+DEFINE_int32(retry_max_attempts, 2,
+             "Retries per request after TIMEOUT, UNAVAILABLE or OVERLOADED, "
+             "0 disables retrying");
+DEFINE_int32(retry_base_backoff_ms, 5, "Backoff before the first retry");
+DEFINE_int32(retry_max_backoff_ms, 100, "Upper bound of the retry backoff");
+DEFINE_double(retry_budget_ratio, 0.1,
+              "Retries allowed per request across all requests");
+DEFINE_bool(retry_downgrade_consistency, false,
+            "Retry UNAVAILABLE at a weaker consistency level");
+DEFINE_bool(write_behind, false,
+            "Acknowledge Store once queued and write to Cassandra in batches");
+DEFINE_int32(write_behind_queue_size, 100000,
+             "Messages held in memory before Store spills to local disk; "
+             "as many again may wait for the spill thread");
+DEFINE_int32(write_behind_batch_size, 50,
+             "Maximum number of messages per write-behind batch");
+DEFINE_int32(write_behind_flushers, 2,
+             "Number of threads draining the write-behind queue");
+DEFINE_string(write_behind_spill_path, "offline_spill.log",
+              "Local log for messages that could not be queued or written");
+DEFINE_int32(offline_shards, 0,
+             "Number of CPU-pinned shards with private connection pools, at "
+             "most one per CPU; 0 shares one RingCache across all threads");
+DEFINE_int32(offline_shard_clients, 4,
+             "Connections per host opened up front in the pools of each "
+             "shard; more are opened on demand");
+DEFINE_int32(completion_threads, 0,
+             "Threads running Store/Retrieve callbacks, 0 runs them inline");
+DEFINE_int32(completion_batch_size, 16,
+             "Callbacks a completion thread takes from its queue at once");
+DEFINE_int32(mailbox_cache_mb, 0,
+             "Size of the in-process mailbox cache for Retrieve, 0 disables");
+DEFINE_int32(mailbox_cache_shards, 16, "Number of mailbox cache shards");
+DEFINE_int32(mailbox_cache_ttl_ms, 30000,
+             "Time after which a cached mailbox is fetched again");
+
 using namespace ::apache::thrift;
 using namespace ::org::apache::cassandra;
 
-OfflineManager::OfflineManager() {
-  ring_cache_ = &RingCache::GetInstance();
+// Ends a request accepted by AcceptRequest when the request body returns.
+class OfflineManager::InFlightScope {
+ public:
+  explicit InFlightScope(OfflineManager* manager) : manager_(manager) {}
+  ~InFlightScope() { manager_->EndRequest(); }
+
+ private:
+  OfflineManager* manager_;
+};
+
+OfflineManager::OfflineManager()
+    : ring_cache_(NULL), draining_(false), in_flight_(0) {
   // Todo: create a thread specially for refreshing endpointmap(and maybe clientpools)
+  if (!ParseConsistencyLevel(FLAGS_store_consistency, &store_consistency_)) {
+    LOG(ERROR) << "Unknown --store_consistency, using ONE";
+    store_consistency_ = ConsistencyLevel::ONE;
+  }
+  if (!ParseConsistencyLevel(FLAGS_retrieve_consistency,
+                             &retrieve_consistency_)) {
+    LOG(ERROR) << "Unknown --retrieve_consistency, using ONE";
+    retrieve_consistency_ = ConsistencyLevel::ONE;
+  }
+  if (FLAGS_retry_max_attempts > 0) {
+    retry_policy_.reset(new BackoffRetryPolicy(
+        FLAGS_retry_max_attempts, FLAGS_retry_base_backoff_ms * 1000,
+        FLAGS_retry_max_backoff_ms * 1000, FLAGS_retry_budget_ratio,
+        FLAGS_retry_downgrade_consistency));
+  } else {
+    retry_policy_.reset(new NoRetryPolicy);
+  }
+  if (FLAGS_write_behind) {
+    write_behind_.reset(new WriteBehindQueue(
+        std::tr1::bind(&OfflineManager::StoreBatch, this,
+                       std::tr1::placeholders::_1),
+        FLAGS_write_behind_queue_size, FLAGS_write_behind_batch_size,
+        FLAGS_write_behind_spill_path));
+  }
+  if (FLAGS_mailbox_cache_mb > 0) {
+    mailbox_cache_.reset(new MailboxCache(
+        FLAGS_mailbox_cache_shards,
+        static_cast<size_t>(FLAGS_mailbox_cache_mb) << 20,
+        FLAGS_mailbox_cache_ttl_ms));
+  }
+  if (FLAGS_completion_threads > 0) {
+    completion_executor_.reset(new CompletionExecutor(
+        FLAGS_completion_threads, FLAGS_completion_batch_size));
+  }
+  if (FLAGS_offline_shards > 0)
+    CreateShards();
+  else
+    ring_cache_ = &RingCache::GetInstance();
+  // Last, since the flushers call StoreBatch, which needs the routing, the
+  // cache and the shards, right away when a spill log is left to replay.
+  if (write_behind_)
+    write_behind_->Start(FLAGS_write_behind_flushers);
+}
+
+void OfflineManager::CreateShards() {
+  int num_cpus = boost::thread::hardware_concurrency();
+  if (num_cpus <= 0)
+    num_cpus = 1;
+  int num_shards = FLAGS_offline_shards;
+  if (num_shards > num_cpus) {
+    LOG(WARNING) << "Only " << num_cpus << " CPUs, using as many shards";
+    num_shards = num_cpus;
+  }
+  // Shard i owns a contiguous block of CPUs, and a request goes to the
+  // shard owning the CPU it was issued on.
+  shard_of_cpu_.resize(num_cpus);
+  for (int i = 0; i < num_shards; ++i) {
+    int first_cpu = i * num_cpus / num_shards;
+    int end_cpu = (i + 1) * num_cpus / num_shards;
+    for (int cpu = first_cpu; cpu < end_cpu; ++cpu)
+      shard_of_cpu_[cpu] = i;
+    shards_.push_back(boost::shared_ptr<OfflineShard>(new OfflineShard(
+        first_cpu, end_cpu - first_cpu, FLAGS_offline_shard_clients)));
+  }
 }
 
 OfflineManager::~OfflineManager() {
+  if (write_behind_)
+    write_behind_->Stop();
 }
 
-void OfflineManager::Store(std::tr1::function<void(bool success)>cob,
-                           const Message& message) {
-  std::string row_key = message.receiver_id;
-  CassClientPool::Node* pnode = ring_cache_->GetClientNode(row_key);
-  try {
-    CqlResult result;
-    std::string query = "INSERT INTO receiver_table(receiver_id, ts, msg_id, "
-        "group_id, msg, sender_id) VALUES('" + message.receiver_id + "','" +
-        message.timestamp + "','" + message.msg_id + "','" + message.group_id
-        + "','" + message.msg + "','" + message.sender_id + "');";
-    pnode->client->execute_cql3_query(result, query, Compression::NONE,
-                                      ConsistencyLevel::ONE);
-    ring_cache_->ReturnClientNode(pnode);
-    cob(true);
-  } catch (InvalidRequestException& ire) {
-    printf("Exception in OfflineManager::Store: %s, [%s]\n", ire.what(),
-           ire.why.c_str());
-  } catch (TimedOutException& te) {
-    printf("Exception in OfflineManager::Store: %s\n", te.what());
-  } catch (SchemaDisagreementException& sde) {
-    printf("Exception in OfflineManager::Store: %s\n", sde.what());
+void OfflineManager::Store(
+    std::tr1::function<void(OfflineStatus::type status)>cob,
+    const Message& message, int64_t deadline_ms) {
+  if (!AcceptRequest()) {
+    cob(OfflineStatus::UNAVAILABLE);
+    return;
   }
+  DoStore(PickRingCache(), cob, message, ResolveDeadline(deadline_ms));
 }
 
 void OfflineManager::Retrieve(
-    std::tr1::function<void(std::vector<Message> const& msgs)>cob,
-    std::string const& receiver) {
-  CassClientPool::Node* pnode = ring_cache_->GetClientNode(receiver);
-  try {
+    std::tr1::function<void(OfflineStatus::type status,
+                            std::vector<Message> const& msgs)>cob,
+    std::string const& receiver, int64_t deadline_ms) {
+  if (!AcceptRequest()) {
+    cob(OfflineStatus::UNAVAILABLE, std::vector<Message>());
+    return;
+  }
+  DoRetrieve(PickRingCache(), cob, receiver, ResolveDeadline(deadline_ms));
+}
+
+void OfflineManager::RetrievePaged(
+    std::tr1::function<void(OfflineStatus::type status,
+                            std::vector<Message> const& msgs,
+                            bool last_page)>cob,
+    std::string const& receiver, int page_size, std::string const& since_ts,
+    int64_t deadline_ms) {
+  if (!AcceptRequest()) {
+    cob(OfflineStatus::UNAVAILABLE, std::vector<Message>(), true);
+    return;
+  }
+  DoRetrievePaged(PickRingCache(), cob, receiver, page_size, since_ts,
+                  deadline_ms);
+}
+
+void OfflineManager::DoStore(
+    RingCache* ring_cache,
+    std::tr1::function<void(OfflineStatus::type status)>cob,
+    const Message& message, int64_t deadline_ms) {
+  InFlightScope in_flight(this);
+  OfflineStatus::type status;
+  if (write_behind_) {
+    // The cache follows once the flusher has written the message.
+    status = write_behind_->Push(message) ? OfflineStatus::OK
+                                          : OfflineStatus::UNAVAILABLE;
+  } else {
+    CqlResult result;
+    status = ExecuteQuery(ring_cache, message.receiver_id,
+                          InsertStatement(message), store_consistency_,
+                          deadline_ms, &result);
+    UpdateCache(message, status);
+  }
+  Complete(std::tr1::bind(cob, status));
+}
+
+void OfflineManager::DoRetrieve(
+    RingCache* ring_cache,
+    std::tr1::function<void(OfflineStatus::type status,
+                            std::vector<Message> const& msgs)>cob,
+    std::string const& receiver, int64_t deadline_ms) {
+  InFlightScope in_flight(this);
+  std::string query = "SELECT * FROM " +
+      CassClientPool::TableName("receiver_table") + " WHERE receiver_id = '" +
+      receiver + "';";
+  std::vector<Message> msgs;
+  uint64_t fill_token = 0;
+  if (mailbox_cache_ && mailbox_cache_->Lookup(receiver, &msgs, &fill_token)) {
+    Complete(std::tr1::bind(cob, OfflineStatus::OK, msgs));
+    return;
+  }
+  CqlResult result;
+  OfflineStatus::type status =
+      ExecuteQuery(ring_cache, receiver, query, retrieve_consistency_,
+                   deadline_ms, &result);
+  if (status == OfflineStatus::OK) {
+    // A mailbox that does not fit the packed format is not cached at all,
+    // rather than cached without the oversized messages.
+    PackedMessageBatch batch;
+    if (mailbox_cache_ && PackRows(result, &batch))
+      mailbox_cache_->Insert(receiver, batch, fill_token);
+    ParseRows(result, &msgs);
+  }
+  Complete(std::tr1::bind(cob, status, msgs));
+}
+
+void OfflineManager::DoRetrievePaged(
+    RingCache* ring_cache,
+    std::tr1::function<void(OfflineStatus::type status,
+                            std::vector<Message> const& msgs,
+                            bool last_page)>cob,
+    std::string const& receiver, int page_size, std::string const& since_ts,
+    int64_t deadline_ms) {
+  InFlightScope in_flight(this);
+  if (page_size <= 0)
+    page_size = FLAGS_retrieve_page_size;
+  // Rows of one receiver are ordered by (ts, msg_id), and several may share
+  // a ts, so later pages continue after the last row's full clustering key.
+  std::string cursor_ts = since_ts;
+  std::string cursor_msg_id;
+  for (;;) {
+    std::string query = "SELECT * FROM " +
+        CassClientPool::TableName("receiver_table") + " WHERE receiver_id = '"
+        + receiver + "'";
+    if (!cursor_msg_id.empty())
+      query += " AND (ts, msg_id) > ('" + cursor_ts + "', '" + cursor_msg_id +
+          "')";
+    else if (!cursor_ts.empty())
+      query += " AND ts > '" + cursor_ts + "'";
+    query += " LIMIT " + std::to_string(page_size) + ";";
+    // Each page is fetched on its own node so that a slow consumer does not
+    // hold a pooled connection between pages.
     CqlResult result;
-    std::string query = "SELECT * FROM receiver_table WHERE receiver_id = '"
-                        + receiver + "';";
-    pnode->client->execute_cql3_query(result, query, Compression::NONE,
-                                      ConsistencyLevel::ONE);
-    Message message;
     std::vector<Message> msgs;
-    for (int i = 0; i < result.rows.size(); ++i) {
-      message.__set_receiver_id(result.rows[i].columns[0].value);
-      message.__set_timestamp(result.rows[i].columns[1].value);
-      message.__set_msg_id(result.rows[i].columns[2].value);
-      message.__set_group_id(result.rows[i].columns[3].value);
-      message.__set_msg(result.rows[i].columns[4].value);
-      message.__set_sender_id(result.rows[i].columns[5].value);
-      msgs.push_back(message);
+    OfflineStatus::type status = ExecuteQuery(
+        ring_cache, receiver, query, retrieve_consistency_,
+        ResolveDeadline(deadline_ms), &result);
+    if (status != OfflineStatus::OK) {
+      cob(status, msgs, true);
+      return;
+    }
+    ParseRows(result, &msgs);
+    bool last_page = msgs.size() < static_cast<size_t>(page_size);
+    if (!msgs.empty()) {
+      cursor_ts = msgs.back().timestamp;
+      cursor_msg_id = msgs.back().msg_id;
+    }
+    cob(status, msgs, last_page);
+    if (last_page)
+      return;
+  }
+}
+
+bool OfflineManager::WaitUntilReady(int timeout_ms) {
+  int64_t deadline = GetTimeStampInMs() + timeout_ms;
+  bool ready = ring_cache_ == NULL || ring_cache_->WaitUntilReady(timeout_ms);
+  for (size_t i = 0; i < shards_.size(); ++i) {
+    int64_t remaining = deadline - GetTimeStampInMs();
+    ready = shards_[i]->WaitUntilReady(remaining > 0 ? remaining : 0) &&
+            ready;
+  }
+  return ready;
+}
+
+bool OfflineManager::Drain(int timeout_ms) {
+  int64_t deadline = GetTimeStampInMs() + timeout_ms;
+  draining_ = true;
+  bool drained = true;
+  {
+    boost::unique_lock<boost::mutex> lock(drain_mutex_);
+    boost::chrono::steady_clock::time_point until =
+        boost::chrono::steady_clock::now() +
+        boost::chrono::milliseconds(timeout_ms);
+    while (in_flight_.load() > 0) {
+      if (drain_cond_.wait_until(lock, until) ==
+              boost::cv_status::timeout && in_flight_.load() > 0) {
+        LOG(WARNING) << in_flight_.load() << " requests still in flight";
+        drained = false;
+        break;
+      }
     }
-    ring_cache_->ReturnClientNode(pnode);
-    cob(msgs);
+  }
+  // The write-behind flushers still need the connections, so they stop
+  // before the pools close. Stragglers only see their Push fail.
+  if (write_behind_)
+    write_behind_->Stop();
+  // Requests still running may submit callbacks, which the executor does
+  // not support while stopping, and still use the shards' pools.
+  if (drained && completion_executor_)
+    completion_executor_->Stop();
+  if (ring_cache_ != NULL)
+    drained = ring_cache_->Drain(deadline) && drained;
+  for (size_t i = 0; i < shards_.size(); ++i)
+    drained = shards_[i]->ring_cache()->Drain(deadline) && drained;
+  if (drained)
+    shards_.clear();
+  return drained;
+}
+
+bool OfflineManager::AcceptRequest() {
+  // Counted before the check, so Drain either sees the request in flight or
+  // the request sees draining_.
+  std::atomic_fetch_add(&in_flight_, static_cast<size_t>(1));
+  if (!draining_)
+    return true;
+  EndRequest();
+  return false;
+}
+
+void OfflineManager::EndRequest() {
+  if (std::atomic_fetch_sub(&in_flight_, static_cast<size_t>(1)) == 1 &&
+      draining_) {
+    LockGuard<boost::mutex> lock(drain_mutex_);
+    drain_cond_.notify_all();
+  }
+}
+
+bool OfflineManager::GetCompletionStats(CompletionExecutor::Stats* stats) {
+  if (!completion_executor_)
+    return false;
+  completion_executor_->GetStats(stats);
+  return true;
+}
+
+void OfflineManager::Complete(CompletionExecutor::Task const& done) {
+  if (completion_executor_)
+    completion_executor_->Submit(done);
+  else
+    done();
+}
+
+RingCache* OfflineManager::PickRingCache() {
+  if (ring_cache_ != NULL)
+    return ring_cache_;
+  int cpu = sched_getcpu();
+  return shards_[shard_of_cpu_[(cpu > 0 ? cpu : 0) % shard_of_cpu_.size()]]
+      ->ring_cache();
+}
+
+bool OfflineManager::GetCacheStats(MailboxCache::Stats* stats) {
+  if (!mailbox_cache_)
+    return false;
+  mailbox_cache_->GetStats(stats);
+  return true;
+}
+
+OfflineStatus::type OfflineManager::ExecuteQuery(
+    RingCache* ring_cache, std::string const& row_key, std::string query,
+    ConsistencyLevel::type consistency, int64_t deadline_ms,
+    CqlResult* result) {
+  // Compress before taking a node so the connection is held only for I/O.
+  Compression::type compression = CompressQuery(&query);
+  retry_policy_->OnRequest();
+  std::string server;
+  bool same_host = false;
+  for (int attempt = 0; ; ++attempt) {
+    OfflineStatus::type status =
+        ExecuteOnce(ring_cache, row_key, query, compression, consistency,
+                    deadline_ms, same_host, &server, result);
+    if (status == OfflineStatus::OK)
+      return status;
+    RetryDecision decision =
+        retry_policy_->OnFailure(attempt, status, consistency);
+    if (decision.action == RetryDecision::FAIL ||
+        GetTimeStampInMs() + decision.backoff_us / 1000 >= deadline_ms)
+      return status;
+    if (decision.backoff_us > 0)
+      boost::this_thread::sleep_for(
+          boost::chrono::microseconds(decision.backoff_us));
+    // |server| stays empty if the attempt never got a node, so the retry
+    // goes to any replica.
+    same_host = decision.action == RetryDecision::RETRY_SAME_HOST &&
+                !server.empty();
+    consistency = decision.consistency;
+  }
+}
+
+OfflineStatus::type OfflineManager::ExecuteOnce(
+    RingCache* ring_cache, std::string const& row_key,
+    std::string const& query, Compression::type compression,
+    ConsistencyLevel::type consistency, int64_t deadline_ms, bool same_host,
+    std::string* server, CqlResult* result) {
+  bool shed = false;
+  std::string tried_server;
+  CassClientPool::Node* pnode =
+      same_host ? ring_cache->GetServerNode(*server, deadline_ms, &shed)
+                : ring_cache->GetClientNode(row_key, deadline_ms, *server,
+                                            &shed, &tried_server);
+  if (pnode == NULL) {
+    // The retry then avoids the replica that failed.
+    if (!tried_server.empty())
+      *server = tried_server;
+    if (shed)
+      return OfflineStatus::OVERLOADED;
+    return GetTimeStampInMs() >= deadline_ms ? OfflineStatus::TIMEOUT
+                                             : OfflineStatus::UNAVAILABLE;
+  }
+  if (GetTimeStampInMs() >= deadline_ms) {
+    ring_cache->ReturnClientNode(pnode);
+    return OfflineStatus::TIMEOUT;
+  }
+
+  *server = pnode->cass_server;
+  OfflineStatus::type status = OfflineStatus::OK;
+  bool discard = false;
+  bool host_down = false;
+  bool timed_out = false;
+  try {
+    pnode->SetDeadline(deadline_ms);
+    pnode->Execute(*result, query, compression, consistency);
   } catch (InvalidRequestException& ire) {
-    printf("Exception in OfflineManager::Retrieve: %s, [%s]\n", ire.what(),
-           ire.why.c_str());
+    LOG(WARNING) << "InvalidRequestException on " << pnode->cass_server
+                 << ": " << ire.why;
+    status = OfflineStatus::INVALID;
   } catch (UnavailableException& ue) {
-    printf("Exception in OfflineManager::Retrieve: %s\n", ue.what());
+    LOG(WARNING) << "UnavailableException on " << pnode->cass_server;
+    status = OfflineStatus::UNAVAILABLE;
   } catch (TimedOutException& te) {
-    printf("Exception in OfflineManager::Retrieve: %s\n", te.what());
+    LOG(WARNING) << "TimedOutException on " << pnode->cass_server;
+    status = OfflineStatus::TIMEOUT;
+    timed_out = true;
   } catch (SchemaDisagreementException& sde) {
-    printf("Exception in OfflineManager::Retrieve: %s\n", sde.what());
+    LOG(WARNING) << "SchemaDisagreementException on " << pnode->cass_server;
+    status = OfflineStatus::UNAVAILABLE;
+  } catch (TTransportException& te) {
+    // The connection state is unknown after a transport error (a reply may
+    // still arrive later), so it must not be reused.
+    LOG(WARNING) << "TTransportException on " << pnode->cass_server << ": "
+                 << te.what() << " [" << te.getType() << "]";
+    status = te.getType() == TTransportException::TIMED_OUT ?
+        OfflineStatus::TIMEOUT : OfflineStatus::UNAVAILABLE;
+    discard = true;
+    host_down = CassClientPool::IsHostDown(te);
+  } catch (TException& tx) {
+    LOG(WARNING) << "TException on " << pnode->cass_server << ": "
+                 << tx.what();
+    status = OfflineStatus::UNAVAILABLE;
+    discard = true;
   }
+  if (discard)
+    ring_cache->DiscardClientNode(pnode, host_down);
+  else
+    ring_cache->ReturnClientNode(pnode, timed_out);
+  return status;
+}
+
+OfflineStatus::type OfflineManager::StoreBatch(
+    std::vector<Message> const& batch) {
+  std::string query = "BEGIN UNLOGGED BATCH ";
+  for (size_t i = 0; i < batch.size(); ++i)
+    query += InsertStatement(batch[i]) + " ";
+  query += "APPLY BATCH;";
+  // The coordinator forwards rows owned by other replicas, so routing by
+  // the first receiver is enough.
+  CqlResult result;
+  OfflineStatus::type status =
+      ExecuteQuery(PickRingCache(), batch[0].receiver_id, query,
+                   store_consistency_, ResolveDeadline(0), &result);
+  for (size_t i = 0; i < batch.size(); ++i)
+    UpdateCache(batch[i], status);
+  return status;
+}
+
+void OfflineManager::UpdateCache(const Message& written,
+                                 OfflineStatus::type status) {
+  if (!mailbox_cache_)
+    return;
+  // A failed write may still have been applied by some replica, so the
+  // cached mailbox can no longer be trusted either way.
+  if (status == OfflineStatus::OK)
+    mailbox_cache_->Append(written);
+  else
+    mailbox_cache_->Invalidate(written.receiver_id);
 }
 
+std::string OfflineManager::InsertStatement(const Message& message) {
+  return "INSERT INTO " + CassClientPool::TableName("receiver_table") +
+      "(receiver_id, ts, msg_id, group_id, msg, sender_id) VALUES('" +
+      message.receiver_id + "','" + message.timestamp + "','" +
+      message.msg_id + "','" + message.group_id + "','" + message.msg +
+      "','" + message.sender_id + "');";
+}
+
+int64_t OfflineManager::ResolveDeadline(int64_t deadline_ms) {
+  if (deadline_ms > 0)
+    return deadline_ms;
+  return GetTimeStampInMs() + FLAGS_offline_request_timeout_ms;
+}
+
+void OfflineManager::ParseRows(CqlResult const& result,
+                               std::vector<Message>* msgs) {
+  size_t first = msgs->size();
+  msgs->resize(first + result.rows.size());
+  for (size_t i = 0; i < result.rows.size(); ++i) {
+    std::vector<Column> const& columns = result.rows[i].columns;
+    Message& message = (*msgs)[first + i];
+    message.__set_receiver_id(columns[0].value);
+    message.__set_timestamp(columns[1].value);
+    message.__set_msg_id(columns[2].value);
+    message.__set_group_id(columns[3].value);
+    message.__set_msg(columns[4].value);
+    message.__set_sender_id(columns[5].value);
+  }
+}
+
+bool OfflineManager::PackRows(CqlResult const& result,
+                              PackedMessageBatch* msgs) {
+  for (size_t i = 0; i < result.rows.size(); ++i) {
+    std::vector<Column> const& columns = result.rows[i].columns;
+    if (!msgs->Append(columns[0].value, columns[1].value, columns[2].value,
+                      columns[3].value, columns[4].value, columns[5].value))
+      return false;
+  }
+  return true;
+}
@@ -1,10 +1,21 @@
 #ifndef OFFLINE_MANAGER_H_
 #define OFFLINE_MANAGER_H_
 
+#include "Cassandra.h"
+
+#include <stdint.h>
+#include <atomic>
 #include <vector>
 
 #include "common/idl/message_types.h"
+#include "completion_executor.h"
+#include "mailbox_cache.h"
+#include "offline_shard.h"
+#include "offline_status.h"
+#include "packed_message.h"
+#include "retry_policy.h"
 #include "ring_cache.h"
+#include "write_behind_queue.h"
 #include "thirdparty/boost/thread/thread.hpp"
 #include "thirdparty/gflags/gflags.h"
 
@@ -17,14 +28,121 @@ class OfflineManager {
   ~OfflineManager();
 
   // public API
-  void Store(std::tr1::function<void(bool success)>cob,
-             const Message& message);
-  void Retrieve(std::tr1::function<void(std::vector<Message> const& msgs)>cob,
-                std::string const& receiver);
+  // |deadline_ms| is an absolute GetTimeStampInMs() value; 0 means now plus
+  // --offline_request_timeout_ms. |cob| is always invoked exactly once.
+  // With --write_behind, Store reports OK as soon as the message is queued
+  // or spilled locally, and the deadline is not used.
+  // With --offline_shards, requests run on the calling thread with the
+  // connection pools of the shard owning the calling CPU.
+  // With --completion_threads, Store and Retrieve callbacks run on the
+  // completion executor; otherwise on the thread that did the I/O.
+  void Store(std::tr1::function<void(OfflineStatus::type status)>cob,
+             const Message& message, int64_t deadline_ms = 0);
+  void Retrieve(std::tr1::function<void(OfflineStatus::type status,
+                                        std::vector<Message> const& msgs)>cob,
+                std::string const& receiver, int64_t deadline_ms = 0);
+  // Streams the mailbox of |receiver| to |cob| in pages of at most
+  // |page_size| messages (FLAGS_retrieve_page_size if 0), ordered by ts.
+  // Only messages with ts greater than |since_ts| are delivered when it is
+  // not empty. |last_page| is true on the final invocation, which is also
+  // the one carrying a non-OK status. The deadline applies to each page.
+  // Pages are always delivered on the calling thread, in order, and the
+  // next page is not fetched before |cob| returns.
+  void RetrievePaged(
+      std::tr1::function<void(OfflineStatus::type status,
+                              std::vector<Message> const& msgs,
+                              bool last_page)>cob,
+      std::string const& receiver, int page_size = 0,
+      std::string const& since_ts = "", int64_t deadline_ms = 0);
+  // Waits until every ring cache in use can reach a replica of every token
+  // range.
+  bool WaitUntilReady(int timeout_ms);
+  // Shuts down without losing accepted work: new requests fail with
+  // UNAVAILABLE from now on, requests in flight get until |timeout_ms| to
+  // finish, then the write-behind queue is flushed, pending callbacks run,
+  // and all connections are closed. Returns false if something was still
+  // in flight when the time ran out.
+  bool Drain(int timeout_ms);
+  // Returns false if the mailbox cache is disabled.
+  bool GetCacheStats(MailboxCache::Stats* stats);
+  // Returns false if callbacks run inline.
+  bool GetCompletionStats(CompletionExecutor::Stats* stats);
+  // Replaces the policy built from the --retry_* flags. Call before the
+  // first request.
+  void SetRetryPolicy(boost::shared_ptr<RetryPolicy> retry_policy) {
+    retry_policy_ = retry_policy;
+  }
 
  private:
   OfflineManager();
-  RingCache* ring_cache_;
+  void CreateShards();
+  // Counts a request as in flight, or returns false once draining. Every
+  // accepted request ends in one of the Do* bodies below.
+  bool AcceptRequest();
+  void EndRequest();
+  class InFlightScope;
+  // Request bodies, run on the calling thread with the ring cache to use.
+  void DoStore(RingCache* ring_cache,
+               std::tr1::function<void(OfflineStatus::type status)>cob,
+               const Message& message, int64_t deadline_ms);
+  void DoRetrieve(RingCache* ring_cache,
+                  std::tr1::function<void(OfflineStatus::type status,
+                                          std::vector<Message> const& msgs)>cob,
+                  std::string const& receiver, int64_t deadline_ms);
+  void DoRetrievePaged(
+      RingCache* ring_cache,
+      std::tr1::function<void(OfflineStatus::type status,
+                              std::vector<Message> const& msgs,
+                              bool last_page)>cob,
+      std::string const& receiver, int page_size, std::string const& since_ts,
+      int64_t deadline_ms);
+  // Hands a bound callback to the completion executor, or runs it.
+  void Complete(CompletionExecutor::Task const& done);
+  // The shared ring cache, or with sharding on the one of the shard owning
+  // the calling CPU.
+  RingCache* PickRingCache();
+  // Runs |query| on a replica of |row_key| at |consistency|, retrying as
+  // retry_policy_ decides for as long as |deadline_ms| allows.
+  OfflineStatus::type ExecuteQuery(RingCache* ring_cache,
+                                   std::string const& row_key,
+                                   std::string query,
+                                   ConsistencyLevel::type consistency,
+                                   int64_t deadline_ms, CqlResult* result);
+  // One attempt of ExecuteQuery on |*server| with |same_host|, else on a
+  // replica other than |*server| if possible; |*server| is set to the
+  // replica used. The node is returned to
+  // its pool on success and on Cassandra-level errors, and discarded when
+  // the connection itself failed or timed out.
+  OfflineStatus::type ExecuteOnce(RingCache* ring_cache,
+                                  std::string const& row_key,
+                                  std::string const& query,
+                                  Compression::type compression,
+                                  ConsistencyLevel::type consistency,
+                                  int64_t deadline_ms, bool same_host,
+                                  std::string* server, CqlResult* result);
+  // Writes |batch| as one unlogged batch; the flush function of
+  // write_behind_.
+  OfflineStatus::type StoreBatch(std::vector<Message> const& batch);
+  // Brings the mailbox cache in line with a write of |written|.
+  void UpdateCache(const Message& written, OfflineStatus::type status);
+  static std::string InsertStatement(const Message& message);
+  static int64_t ResolveDeadline(int64_t deadline_ms);
+  static void ParseRows(CqlResult const& result, std::vector<Message>* msgs);
+  // Returns false at the first row too large for the packed format.
+  static bool PackRows(CqlResult const& result, PackedMessageBatch* msgs);
+  RingCache* ring_cache_;  // NULL when sharding is on
+  ConsistencyLevel::type store_consistency_;
+  ConsistencyLevel::type retrieve_consistency_;
+  boost::shared_ptr<RetryPolicy> retry_policy_;
+  boost::shared_ptr<WriteBehindQueue> write_behind_;
+  boost::shared_ptr<MailboxCache> mailbox_cache_;
+  boost::shared_ptr<CompletionExecutor> completion_executor_;
+  std::vector<boost::shared_ptr<OfflineShard>> shards_;
+  std::vector<int> shard_of_cpu_;
+  std::atomic<bool> draining_;
+  std::atomic<size_t> in_flight_;
+  boost::mutex drain_mutex_;
+  boost::condition_variable drain_cond_;  // in_flight_ reached 0
 };
 
 #endif // OFFLINE_MANAGER_H_
@@ -0,0 +1,36 @@
+#include "offline_shard.h"
+
+#include <pthread.h>
+#include <sched.h>
+
+#include "thirdparty/boost/thread.hpp"
+#include "thirdparty/glog/logging.h"
+
+OfflineShard::OfflineShard(int first_cpu, int num_cpus, int pool_size)
+    : first_cpu_(first_cpu), num_cpus_(num_cpus > 0 ? num_cpus : 1),
+      ring_cache_(NULL) {
+  boost::thread builder(&OfflineShard::Build, this, pool_size);
+  builder.join();
+}
+
+OfflineShard::~OfflineShard() {
+  delete ring_cache_;
+}
+
+bool OfflineShard::WaitUntilReady(int timeout_ms) {
+  return ring_cache_->WaitUntilReady(timeout_ms);
+}
+
+void OfflineShard::Build(int pool_size) {
+  cpu_set_t cpus;
+  CPU_ZERO(&cpus);
+  for (int i = 0; i < num_cpus_; ++i)
+    CPU_SET(first_cpu_ + i, &cpus);
+  if (pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus) != 0)
+    LOG(WARNING) << "Can not pin offline shard to CPUs " << first_cpu_
+                 << "-" << first_cpu_ + num_cpus_ - 1;
+  // Built pinned so the routing table, pools and connection buffers are
+  // first touched, and thus allocated, on this NUMA node. The refresh and
+  // warm-up threads of the ring cache inherit the affinity.
+  ring_cache_ = new RingCache(pool_size);
+}
@@ -0,0 +1,29 @@
+#ifndef OFFLINE_SHARD_H_
+#define OFFLINE_SHARD_H_
+
+#include "ring_cache.h"
+
+// A private RingCache, i.e. its own routing snapshot and connection pools,
+// for the threads running on a block of CPUs. Requests run on the calling
+// thread with the ring cache of the shard owning its CPU, so the pools of
+// a shard only see traffic from those cores and no request changes
+// threads on the way.
+class OfflineShard {
+ public:
+  // Builds the ring cache, with |pool_size| connections per host, on a
+  // thread pinned to CPUs [first_cpu, first_cpu + num_cpus).
+  OfflineShard(int first_cpu, int num_cpus, int pool_size);
+  ~OfflineShard();
+
+  bool WaitUntilReady(int timeout_ms);
+  RingCache* ring_cache() { return ring_cache_; }
+
+ private:
+  void Build(int pool_size);
+
+  int first_cpu_;
+  int num_cpus_;
+  RingCache* ring_cache_;
+};
+
+#endif // OFFLINE_SHARD_H_
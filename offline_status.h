@@ -0,0 +1,26 @@
+#ifndef OFFLINE_STATUS_H_
+#define OFFLINE_STATUS_H_
+
+// Result handed to every OfflineManager callback.
+struct OfflineStatus {
+  enum type {
+    OK = 0,
+    TIMEOUT = 1,      // deadline passed, locally or on the coordinator
+    UNAVAILABLE = 2,  // no usable connection or not enough live replicas
+    INVALID = 3,      // the request was rejected by Cassandra
+    OVERLOADED = 4,   // shed by the client because the replica is saturated
+  };
+};
+
+inline const char* OfflineStatusName(OfflineStatus::type status) {
+  switch (status) {
+    case OfflineStatus::OK: return "OK";
+    case OfflineStatus::TIMEOUT: return "TIMEOUT";
+    case OfflineStatus::UNAVAILABLE: return "UNAVAILABLE";
+    case OfflineStatus::INVALID: return "INVALID";
+    case OfflineStatus::OVERLOADED: return "OVERLOADED";
+  }
+  return "UNKNOWN";
+}
+
+#endif // OFFLINE_STATUS_H_
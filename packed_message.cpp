@@ -0,0 +1,181 @@
+#include "packed_message.h"
+
+#include <stdio.h>
+#include <string.h>
+
+#include <algorithm>
+
+namespace {
+
+enum {
+  kTimestampText = 1,
+  kMsgIdText = 2,
+  kGroupIdText = 4,
+};
+
+// Parses |text| if it is exactly what std::to_string would print for some
+// int64, so the number converts back to the identical string.
+bool ParseCanonical(std::string const& text, int64_t* value) {
+  size_t size = text.size();
+  size_t pos = size > 0 && text[0] == '-' ? 1 : 0;
+  if (size == pos || size - pos > 19)
+    return false;
+  if (text[pos] == '0' && (size - pos > 1 || pos == 1))
+    return false;
+  uint64_t result = 0;
+  for (size_t i = pos; i < size; ++i) {
+    if (text[i] < '0' || text[i] > '9')
+      return false;
+    result = result * 10 + (text[i] - '0');
+  }
+  if (pos == 0 && result > static_cast<uint64_t>(INT64_MAX))
+    return false;
+  if (pos == 1 && result > static_cast<uint64_t>(INT64_MAX) + 1)
+    return false;
+  *value = pos == 1 ? static_cast<int64_t>(0 - result)
+                    : static_cast<int64_t>(result);
+  return true;
+}
+
+// Stores |text| in |*slot| as a number if possible, else records its
+// length there, sets |flag| and queues it for the variable part.
+void PackNumber(std::string const& text, uint16_t flag, int64_t* slot,
+                uint16_t* flags, std::vector<const std::string*>* texts) {
+  if (ParseCanonical(text, slot))
+    return;
+  *slot = text.size();
+  *flags |= flag;
+  texts->push_back(&text);
+}
+
+std::string UnpackNumber(int64_t slot, uint16_t flag, uint16_t flags,
+                         const char** text) {
+  if (!(flags & flag))
+    return std::to_string(slot);
+  std::string result(*text, slot);
+  *text += slot;
+  return result;
+}
+
+// Like UnpackNumber, but formats a number into |scratch|, which must hold
+// 21 bytes, instead of allocating.
+const char* NumberText(int64_t slot, uint16_t flag, uint16_t flags,
+                       const char** text, char* scratch, size_t* size) {
+  if (flags & flag) {
+    const char* result = *text;
+    *size = slot;
+    *text += slot;
+    return result;
+  }
+  *size = snprintf(scratch, 21, "%lld", static_cast<long long>(slot));
+  return scratch;
+}
+
+int CompareText(const char* text, size_t size, std::string const& other) {
+  int result = memcmp(text, other.data(), std::min(size, other.size()));
+  if (result != 0)
+    return result;
+  return size < other.size() ? -1 : size > other.size() ? 1 : 0;
+}
+
+}  // namespace
+
+bool PackedMessageBatch::Append(const Message& message) {
+  return Append(message.receiver_id, message.timestamp, message.msg_id,
+                message.group_id, message.msg, message.sender_id);
+}
+
+bool PackedMessageBatch::Append(
+    std::string const& receiver_id, std::string const& timestamp,
+    std::string const& msg_id, std::string const& group_id,
+    std::string const& msg, std::string const& sender_id) {
+  if (receiver_id.size() > UINT16_MAX || sender_id.size() > UINT16_MAX ||
+      msg.size() > UINT32_MAX)
+    return false;
+  Header header;
+  memset(&header, 0, sizeof(header));
+  std::vector<const std::string*> texts;
+  PackNumber(timestamp, kTimestampText, &header.timestamp, &header.flags,
+             &texts);
+  PackNumber(msg_id, kMsgIdText, &header.msg_id, &header.flags, &texts);
+  PackNumber(group_id, kGroupIdText, &header.group_id, &header.flags,
+             &texts);
+  header.msg_size = msg.size();
+  header.receiver_size = receiver_id.size();
+  header.sender_size = sender_id.size();
+
+  offsets_.push_back(buffer_.size());
+  buffer_.append(reinterpret_cast<const char*>(&header), sizeof(header));
+  buffer_.append(receiver_id);
+  buffer_.append(sender_id);
+  buffer_.append(msg);
+  for (size_t i = 0; i < texts.size(); ++i)
+    buffer_.append(*texts[i]);
+  return true;
+}
+
+void PackedMessageBatch::clear() {
+  buffer_.clear();
+  offsets_.clear();
+}
+
+PackedMessageBatch::Header PackedMessageBatch::ReadHeader(
+    size_t index, const char** fields) const {
+  Header header;
+  const char* record = buffer_.data() + offsets_[index];
+  // memcpy, since records are not aligned inside the buffer.
+  memcpy(&header, record, sizeof(header));
+  *fields = record + sizeof(header);
+  return header;
+}
+
+void PackedMessageBatch::Get(size_t index, Message* message) const {
+  const char* pos;
+  Header header = ReadHeader(index, &pos);
+  message->__set_receiver_id(std::string(pos, header.receiver_size));
+  pos += header.receiver_size;
+  message->__set_sender_id(std::string(pos, header.sender_size));
+  pos += header.sender_size;
+  message->__set_msg(std::string(pos, header.msg_size));
+  pos += header.msg_size;
+  message->__set_timestamp(
+      UnpackNumber(header.timestamp, kTimestampText, header.flags, &pos));
+  message->__set_msg_id(
+      UnpackNumber(header.msg_id, kMsgIdText, header.flags, &pos));
+  message->__set_group_id(
+      UnpackNumber(header.group_id, kGroupIdText, header.flags, &pos));
+}
+
+std::string PackedMessageBatch::Timestamp(size_t index) const {
+  const char* pos;
+  Header header = ReadHeader(index, &pos);
+  pos += header.receiver_size + header.sender_size + header.msg_size;
+  return UnpackNumber(header.timestamp, kTimestampText, header.flags, &pos);
+}
+
+int PackedMessageBatch::CompareKey(size_t index,
+                                   std::string const& timestamp,
+                                   std::string const& msg_id) const {
+  const char* pos;
+  Header header = ReadHeader(index, &pos);
+  pos += header.receiver_size + header.sender_size + header.msg_size;
+  char scratch[21];
+  size_t size;
+  const char* text = NumberText(header.timestamp, kTimestampText,
+                                header.flags, &pos, scratch, &size);
+  int result = CompareText(text, size, timestamp);
+  if (result != 0)
+    return result;
+  text = NumberText(header.msg_id, kMsgIdText, header.flags, &pos, scratch,
+                    &size);
+  return CompareText(text, size, msg_id);
+}
+
+void PackedMessageBatch::AppendTo(std::vector<Message>* msgs) const {
+  msgs->reserve(msgs->size() + size());
+  Message message;
+  for (size_t i = 0; i < size(); ++i) {
+    Get(i, &message);
+    msgs->push_back(message);
+  }
+}
@@ -0,0 +1,71 @@
+#ifndef PACKED_MESSAGE_H_
+#define PACKED_MESSAGE_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <string>
+#include <vector>
+
+#include "common/idl/message_types.h"
+
+// Contiguous container of messages in a packed internal format, used on
+// the offline path instead of vectors of Message. Each record is a fixed
+// header followed by its variable fields:
+//
+//   timestamp, msg_id, group_id  int64 each, as numbers when the field is
+//                                a canonical decimal, else the text length
+//   msg_size                     uint32
+//   receiver_size, sender_size   uint16
+//   flags                        uint16, which numeric fields are text
+//   receiver_id sender_id msg [timestamp] [msg_id] [group_id]
+//
+// so a record costs one header plus its text, and a whole mailbox lives
+// in one buffer instead of six heap strings per message.
+class PackedMessageBatch {
+ public:
+  PackedMessageBatch() {}
+
+  // Both return false, leaving the batch unchanged, if a field is too long
+  // for the record format.
+  bool Append(const Message& message);
+  // Appends the fields of one row without building a Message first.
+  bool Append(std::string const& receiver_id, std::string const& timestamp,
+              std::string const& msg_id, std::string const& group_id,
+              std::string const& msg, std::string const& sender_id);
+
+  size_t size() const { return offsets_.size(); }
+  bool empty() const { return offsets_.empty(); }
+  // Memory held by the records, excluding allocator slack.
+  size_t ByteSize() const {
+    return buffer_.size() + offsets_.size() * sizeof(uint32_t);
+  }
+  void clear();
+
+  // Conversions back to Message at the API boundary.
+  void Get(size_t index, Message* message) const;
+  std::string Timestamp(size_t index) const;
+  // Compares the (timestamp, msg_id) key of record |index| with the given
+  // one, as text, without allocating. Returns <0, 0 or >0 like strcmp.
+  int CompareKey(size_t index, std::string const& timestamp,
+                 std::string const& msg_id) const;
+  void AppendTo(std::vector<Message>* msgs) const;
+
+ private:
+  struct Header {
+    int64_t timestamp;
+    int64_t msg_id;
+    int64_t group_id;
+    uint32_t msg_size;
+    uint16_t receiver_size;
+    uint16_t sender_size;
+    uint16_t flags;
+  };
+
+  Header ReadHeader(size_t index, const char** fields) const;
+
+  std::string buffer_;
+  std::vector<uint32_t> offsets_;
+};
+
+#endif // PACKED_MESSAGE_H_
@@ -0,0 +1,106 @@
+#include "packed_message.h"
+
+#include <string>
+#include <vector>
+
+#include "test_message.h"
+#include "thirdparty/gtest/gtest.h"
+
+namespace {
+
+// A test message with the fields the packed format may store as numbers
+// replaced.
+Message MakeMessage(std::string const& receiver, std::string const& ts,
+                    std::string const& msg_id, std::string const& group_id,
+                    std::string const& msg) {
+  Message message = MakeTestMessage(receiver, 0);
+  message.__set_timestamp(ts);
+  message.__set_msg_id(msg_id);
+  message.__set_group_id(group_id);
+  message.__set_msg(msg);
+  return message;
+}
+
+void ExpectSame(Message const& expected, Message const& actual) {
+  EXPECT_EQ(expected.receiver_id, actual.receiver_id);
+  EXPECT_EQ(expected.timestamp, actual.timestamp);
+  EXPECT_EQ(expected.msg_id, actual.msg_id);
+  EXPECT_EQ(expected.group_id, actual.group_id);
+  EXPECT_EQ(expected.msg, actual.msg);
+  EXPECT_EQ(expected.sender_id, actual.sender_id);
+}
+
+}  // namespace
+
+TEST(PackedMessageBatchTest, RoundTripsNumericAndTextFields) {
+  std::vector<Message> msgs;
+  msgs.push_back(MakeMessage("alice", "1400000000000", "42", "0", "hi"));
+  // Not canonical decimals, so kept as text.
+  msgs.push_back(MakeMessage("bob", "0042", "-0", "group-7", ""));
+  msgs.push_back(MakeMessage("carol", "-9223372036854775808",
+                             "9223372036854775808", "", "x"));
+  msgs.push_back(MakeMessage("", "", "abc", "12", std::string(1000, 'm')));
+
+  PackedMessageBatch batch;
+  for (size_t i = 0; i < msgs.size(); ++i)
+    ASSERT_TRUE(batch.Append(msgs[i]));
+  ASSERT_EQ(msgs.size(), batch.size());
+
+  for (size_t i = 0; i < msgs.size(); ++i) {
+    Message message;
+    batch.Get(i, &message);
+    ExpectSame(msgs[i], message);
+    EXPECT_EQ(msgs[i].timestamp, batch.Timestamp(i));
+    EXPECT_EQ(0, batch.CompareKey(i, msgs[i].timestamp, msgs[i].msg_id));
+  }
+
+  std::vector<Message> out(1);
+  batch.AppendTo(&out);
+  ASSERT_EQ(msgs.size() + 1, out.size());
+  ExpectSame(msgs.back(), out.back());
+}
+
+TEST(PackedMessageBatchTest, CompareKeyOrdersAsText) {
+  PackedMessageBatch batch;
+  ASSERT_TRUE(batch.Append(MakeMessage("alice", "1500", "42", "0", "a")));
+  ASSERT_TRUE(batch.Append(MakeMessage("alice", "1500", "id-9", "0", "b")));
+  EXPECT_EQ(0, batch.CompareKey(0, "1500", "42"));
+  EXPECT_LT(batch.CompareKey(0, "1500", "43"), 0);
+  EXPECT_LT(batch.CompareKey(0, "1501", "1"), 0);
+  EXPECT_GT(batch.CompareKey(0, "1500", "4"), 0);
+  EXPECT_GT(batch.CompareKey(0, "150", "99"), 0);
+  EXPECT_EQ(0, batch.CompareKey(1, "1500", "id-9"));
+  EXPECT_GT(batch.CompareKey(1, "1500", "id-10"), 0);
+}
+
+TEST(PackedMessageBatchTest, RowAppendMatchesMessageAppend) {
+  Message message = MakeMessage("dave", "17", "t-1", "3", "body");
+  PackedMessageBatch from_message, from_row;
+  ASSERT_TRUE(from_message.Append(message));
+  ASSERT_TRUE(from_row.Append(message.receiver_id, message.timestamp,
+                              message.msg_id, message.group_id, message.msg,
+                              message.sender_id));
+  EXPECT_EQ(from_message.ByteSize(), from_row.ByteSize());
+  Message out;
+  from_row.Get(0, &out);
+  ExpectSame(message, out);
+}
+
+TEST(PackedMessageBatchTest, RejectsOversizedFieldUnchanged) {
+  PackedMessageBatch batch;
+  ASSERT_TRUE(batch.Append(MakeMessage("erin", "1", "1", "1", "a")));
+  size_t byte_size = batch.ByteSize();
+
+  EXPECT_FALSE(batch.Append(MakeMessage(std::string(70000, 'r'), "2", "2",
+                                        "2", "b")));
+  EXPECT_EQ(1u, batch.size());
+  EXPECT_EQ(byte_size, batch.ByteSize());
+}
+
+TEST(PackedMessageBatchTest, Clear) {
+  PackedMessageBatch batch;
+  ASSERT_TRUE(batch.Append(MakeMessage("frank", "1", "1", "1", "a")));
+  batch.clear();
+  EXPECT_TRUE(batch.empty());
+  EXPECT_EQ(0u, batch.ByteSize());
+}
@@ -0,0 +1,71 @@
+#include "query_compressor.h"
+
+#include <atomic>
+
+#include "common/base/timestamp.h"
+#include "thirdparty/gflags/gflags.h"
+#include "thirdparty/glog/logging.h"
+#include "thirdparty/zlib/zlib.h"
+
+DEFINE_string(cass_compression, "NONE",
+             "Compression of CQL queries sent to Cassandra--NONE, GZIP");
+DEFINE_int32(cass_compression_threshold, 1024,
+             "Queries shorter than this many bytes are never compressed");
+DEFINE_int32(cass_compression_level, 1,
+             "zlib level (1-9) used when --cass_compression=GZIP");
+
+namespace {
+
+std::atomic<uint64_t> compressed_count(0);
+std::atomic<uint64_t> skipped_count(0);
+std::atomic<uint64_t> raw_bytes(0);
+std::atomic<uint64_t> wire_bytes(0);
+std::atomic<uint64_t> compress_time_us(0);
+
+void CountSkipped(size_t size) {
+  std::atomic_fetch_add(&skipped_count, static_cast<uint64_t>(1));
+  std::atomic_fetch_add(&raw_bytes, static_cast<uint64_t>(size));
+  std::atomic_fetch_add(&wire_bytes, static_cast<uint64_t>(size));
+}
+
+}  // namespace
+
+Compression::type CompressQuery(std::string* query) {
+  // The Thrift interface only knows GZIP (a zlib stream inflated by the
+  // coordinator) and NONE, so those are the only supported settings.
+  if (FLAGS_cass_compression != "GZIP" ||
+      query->size() < static_cast<size_t>(FLAGS_cass_compression_threshold)) {
+    CountSkipped(query->size());
+    return Compression::NONE;
+  }
+
+  int64_t start_time = GetTimeStampInUs();
+  uLongf length = compressBound(query->size());
+  std::string compressed(length, '\0');
+  int ret = compress2(reinterpret_cast<Bytef*>(&compressed[0]), &length,
+                      reinterpret_cast<const Bytef*>(query->data()),
+                      query->size(), FLAGS_cass_compression_level);
+  std::atomic_fetch_add(&compress_time_us,
+      static_cast<uint64_t>(GetTimeStampInUs() - start_time));
+  if (ret != Z_OK || length >= query->size()) {
+    if (ret != Z_OK)
+      LOG(WARNING) << "compress2 failed: " << ret;
+    CountSkipped(query->size());
+    return Compression::NONE;
+  }
+
+  compressed.resize(length);
+  std::atomic_fetch_add(&compressed_count, static_cast<uint64_t>(1));
+  std::atomic_fetch_add(&raw_bytes, static_cast<uint64_t>(query->size()));
+  std::atomic_fetch_add(&wire_bytes, static_cast<uint64_t>(length));
+  query->swap(compressed);
+  return Compression::GZIP;
+}
+
+void GetCompressionStats(CompressionStats* stats) {
+  stats->compressed_count = compressed_count.load();
+  stats->skipped_count = skipped_count.load();
+  stats->raw_bytes = raw_bytes.load();
+  stats->wire_bytes = wire_bytes.load();
+  stats->compress_time_us = compress_time_us.load();
+}
@@ -0,0 +1,27 @@
+#ifndef QUERY_COMPRESSOR_H_
+#define QUERY_COMPRESSOR_H_
+
+#include "Cassandra.h"
+
+#include <stdint.h>
+#include <string>
+
+using namespace ::org::apache::cassandra;
+
+struct CompressionStats {
+  uint64_t compressed_count;  // queries sent compressed
+  uint64_t skipped_count;     // queries sent as is (small or incompressible)
+  uint64_t raw_bytes;         // query bytes before compression
+  uint64_t wire_bytes;        // query bytes actually sent
+  uint64_t compress_time_us;  // CPU time spent in deflate
+};
+
+// Compresses |query| in place when --cass_compression is enabled and the
+// query is at least --cass_compression_threshold bytes long, and returns
+// the Compression value to pass to execute_cql3_query. Falls back to
+// Compression::NONE when deflate does not make the query smaller.
+Compression::type CompressQuery(std::string* query);
+
+void GetCompressionStats(CompressionStats* stats);
+
+#endif // QUERY_COMPRESSOR_H_
@@ -7,6 +7,8 @@ class Range {
  public:
   Range(int64_t left, int64_t right);
   bool Contain(int64_t token);
+  int64_t left() const { return left_; }
+  int64_t right() const { return right_; }
 
  private:
   int64_t left_;
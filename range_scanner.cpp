@@ -0,0 +1,244 @@
+#include "range_scanner.h"
+
+#include <stdio.h>
+
+#include <algorithm>
+#include <limits>
+#include <map>
+
+#include "cass_client_pool.h"
+#include "common/base/timestamp.h"
+#include "lock_guard.h"
+#include "murmurhash3.h"
+#include "query_compressor.h"
+#include "thirdparty/gflags/gflags.h"
+#include "thirdparty/glog/logging.h"
+
+DEFINE_int32(scan_page_timeout_ms, 10000,
+             "Time allowed for one page of a range scan on one replica");
+
+namespace {
+
+int64_t TokenOf(std::string const& row_key) {
+  int64_t hash[2];
+  MurmurHash3_x64_128(row_key.c_str(), row_key.size(), 0, hash);
+  return hash[0];
+}
+
+std::string ToString(int64_t value) {
+  char buf[32];
+  snprintf(buf, sizeof(buf), "%lld", static_cast<long long>(value));
+  return buf;
+}
+
+}  // namespace
+
+RangeScanner::RangeScanner(RingCache* ring_cache, RowSink sink,
+                           int num_threads, int splits_per_range,
+                           int page_size, ConsistencyLevel::type consistency)
+    : ring_cache_(ring_cache), sink_(sink),
+      num_threads_(std::max(num_threads, 1)),
+      splits_per_range_(std::max(splits_per_range, 1)),
+      page_size_(std::max(page_size, 1)), consistency_(consistency),
+      num_sub_ranges_(0), num_failed_(0), num_pages_(0), num_rows_(0) {
+}
+
+bool RangeScanner::Scan() {
+  Split();
+  num_sub_ranges_ = sub_ranges_.size();
+  std::vector<boost::thread*> workers;
+  for (int i = 0; i < num_threads_; ++i)
+    workers.push_back(new boost::thread(&RangeScanner::ScanLoop, this));
+  for (size_t i = 0; i < workers.size(); ++i) {
+    workers[i]->join();
+    delete workers[i];
+  }
+  return num_failed_ == 0;
+}
+
+void RangeScanner::GetStats(Stats* stats) {
+  stats->sub_ranges = num_sub_ranges_;
+  stats->failed_sub_ranges = num_failed_;
+  stats->pages = num_pages_;
+  stats->rows = num_rows_;
+}
+
+void RangeScanner::Split() {
+  std::vector<RingRange> ranges;
+  ring_cache_->GetRingRanges(&ranges);
+  // A range that wraps around the ring is scanned as its two halves, since
+  // token(receiver_id) > left AND token(receiver_id) <= right is empty then.
+  std::vector<RingRange> linear;
+  for (size_t i = 0; i < ranges.size(); ++i) {
+    if (ranges[i].replicas.empty())
+      continue;
+    if (ranges[i].left < ranges[i].right) {
+      linear.push_back(ranges[i]);
+      continue;
+    }
+    RingRange high = ranges[i];
+    high.right = std::numeric_limits<int64_t>::max();
+    if (high.left < high.right)
+      linear.push_back(high);
+    RingRange low = ranges[i];
+    low.left = std::numeric_limits<int64_t>::min();
+    if (low.left < low.right)
+      linear.push_back(low);
+  }
+
+  // Queue the sub-ranges of every host in turn, so the first workers
+  // already spread over all nodes. Sub-ranges of one range rotate through
+  // its replicas.
+  std::map<std::string, std::deque<SubRange>> by_host;
+  for (size_t i = 0; i < linear.size(); ++i) {
+    uint64_t width = static_cast<uint64_t>(linear[i].right) -
+        static_cast<uint64_t>(linear[i].left);
+    uint64_t splits = std::min<uint64_t>(splits_per_range_, width);
+    uint64_t step = width / splits;
+    int64_t left = linear[i].left;
+    for (uint64_t s = 0; s < splits; ++s) {
+      SubRange sub_range;
+      sub_range.left = left;
+      sub_range.right = s + 1 == splits ? linear[i].right :
+          static_cast<int64_t>(static_cast<uint64_t>(left) + step);
+      left = sub_range.right;
+      std::vector<std::string> const& replicas = linear[i].replicas;
+      for (size_t r = 0; r < replicas.size(); ++r)
+        sub_range.replicas.push_back(replicas[(s + r) % replicas.size()]);
+      by_host[sub_range.replicas[0]].push_back(sub_range);
+    }
+  }
+  sub_ranges_.clear();
+  for (bool more = true; more; ) {
+    more = false;
+    for (auto it = by_host.begin(); it != by_host.end(); ++it) {
+      if (it->second.empty())
+        continue;
+      sub_ranges_.push_back(it->second.front());
+      it->second.pop_front();
+      more = true;
+    }
+  }
+}
+
+void RangeScanner::ScanLoop() {
+  for (;;) {
+    SubRange sub_range;
+    {
+      LockGuard<boost::mutex> lock(mutex_);
+      if (sub_ranges_.empty())
+        return;
+      sub_range = sub_ranges_.front();
+      sub_ranges_.pop_front();
+    }
+    if (!ScanSubRange(sub_range)) {
+      LOG(WARNING) << "Failed to scan tokens (" << sub_range.left << ", "
+                   << sub_range.right << "]";
+      std::atomic_fetch_add(&num_failed_, static_cast<uint64_t>(1));
+    }
+  }
+}
+
+bool RangeScanner::ScanSubRange(SubRange const& sub_range) {
+  std::string const table = CassClientPool::TableName("receiver_table");
+  std::string const columns =
+      "SELECT receiver_id, ts, msg_id, group_id, msg, sender_id FROM ";
+  std::string const limit = " LIMIT " + ToString(page_size_) + ";";
+  int64_t cursor = sub_range.left;
+  PackedMessageBatch rows;
+  size_t num_rows;
+  Message last;
+  for (;;) {
+    rows.clear();
+    std::string query = columns + table + " WHERE token(receiver_id) > " +
+        ToString(cursor) + " AND token(receiver_id) <= " +
+        ToString(sub_range.right) + limit;
+    if (!FetchPage(sub_range, query, &rows, &num_rows, &last))
+      return false;
+    if (num_rows == 0)
+      return true;
+    if (!rows.empty())
+      Deliver(rows);
+    if (num_rows < static_cast<size_t>(page_size_))
+      return true;
+    // The page may have stopped inside the last partition; finish it by
+    // clustering key before moving past its token.
+    for (bool partial = true; partial; ) {
+      rows.clear();
+      query = columns + table + " WHERE receiver_id = '" + last.receiver_id +
+          "' AND (ts, msg_id) > ('" + last.timestamp + "', '" +
+          last.msg_id + "')" + limit;
+      if (!FetchPage(sub_range, query, &rows, &num_rows, &last))
+        return false;
+      partial = num_rows == static_cast<size_t>(page_size_);
+      if (!rows.empty())
+        Deliver(rows);
+    }
+    cursor = TokenOf(last.receiver_id);
+    if (cursor >= sub_range.right)
+      return true;
+  }
+}
+
+bool RangeScanner::FetchPage(SubRange const& sub_range, std::string query,
+                             PackedMessageBatch* rows, size_t* num_rows,
+                             Message* last) {
+  Compression::type compression = CompressQuery(&query);
+  for (size_t i = 0; i < sub_range.replicas.size(); ++i) {
+    int64_t deadline_ms = GetTimeStampInMs() + FLAGS_scan_page_timeout_ms;
+    CassClientPool::Node* pnode =
+        ring_cache_->GetServerNode(sub_range.replicas[i], deadline_ms);
+    if (pnode == NULL)
+      continue;
+    CqlResult result;
+    bool discard = false;
+    bool host_down = false;
+    try {
+      pnode->SetDeadline(deadline_ms);
+      pnode->Execute(result, query, compression, consistency_);
+    } catch (InvalidRequestException& ire) {
+      // Every replica would reject the query the same way.
+      LOG(WARNING) << "InvalidRequestException on " << pnode->cass_server
+                   << ": " << ire.why;
+      ring_cache_->ReturnClientNode(pnode);
+      return false;
+    } catch (TTransportException& te) {
+      LOG(WARNING) << "TTransportException on " << pnode->cass_server << ": "
+                   << te.what() << " [" << te.getType() << "]";
+      discard = true;
+      host_down = CassClientPool::IsHostDown(te);
+    } catch (TException& tx) {
+      LOG(WARNING) << "TException on " << pnode->cass_server << ": "
+                   << tx.what();
+      ring_cache_->ReturnClientNode(pnode);
+      continue;
+    }
+    if (discard) {
+      ring_cache_->DiscardClientNode(pnode, host_down);
+      continue;
+    }
+    ring_cache_->ReturnClientNode(pnode);
+    for (size_t r = 0; r < result.rows.size(); ++r) {
+      std::vector<Column> const& columns = result.rows[r].columns;
+      if (!rows->Append(columns[0].value, columns[1].value, columns[2].value,
+                        columns[3].value, columns[4].value, columns[5].value))
+        LOG(WARNING) << "Skipping oversized message of " << columns[0].value;
+    }
+    *num_rows = result.rows.size();
+    if (!result.rows.empty()) {
+      std::vector<Column> const& columns = result.rows.back().columns;
+      last->__set_receiver_id(columns[0].value);
+      last->__set_timestamp(columns[1].value);
+      last->__set_msg_id(columns[2].value);
+    }
+    return true;
+  }
+  return false;
+}
+
+void RangeScanner::Deliver(PackedMessageBatch const& rows) {
+  std::atomic_fetch_add(&num_pages_, static_cast<uint64_t>(1));
+  std::atomic_fetch_add(&num_rows_, static_cast<uint64_t>(rows.size()));
+  LockGuard<boost::mutex> lock(sink_mutex_);
+  sink_(rows);
+}
@@ -0,0 +1,81 @@
+#ifndef RANGE_SCANNER_H_
+#define RANGE_SCANNER_H_
+
+#include "Cassandra.h"
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <atomic>
+#include <deque>
+#include <string>
+#include <vector>
+
+#include "packed_message.h"
+#include "ring_cache.h"
+#include "thirdparty/boost/thread.hpp"
+
+// Full scan of receiver_table in parallel over the token ranges of a
+// RingCache. Every range is split into sub-ranges that worker threads page
+// through with token(receiver_id) > ? AND token(receiver_id) <= ? queries
+// on one of the range's own replicas, so the scan spreads over the nodes
+// and no coordinator forwards rows. Each worker holds at most one page, so
+// memory is bounded by num_threads * page_size rows.
+class RangeScanner {
+ public:
+  // Receives every page of rows. Calls are serialized, in no particular
+  // order across sub-ranges.
+  typedef std::tr1::function<void(PackedMessageBatch const& rows)> RowSink;
+
+  struct Stats {
+    uint64_t sub_ranges;
+    uint64_t failed_sub_ranges;
+    uint64_t pages;
+    uint64_t rows;
+  };
+
+  RangeScanner(RingCache* ring_cache, RowSink sink, int num_threads,
+               int splits_per_range, int page_size,
+               ConsistencyLevel::type consistency);
+
+  // Scans the whole table and blocks until done. Returns false if some
+  // sub-range could not be read from any of its replicas; the rows of the
+  // other sub-ranges have still been delivered.
+  bool Scan();
+  void GetStats(Stats* stats);
+
+ private:
+  struct SubRange {
+    int64_t left;   // exclusive
+    int64_t right;  // inclusive
+    std::vector<std::string> replicas;  // preferred replica first
+  };
+
+  void Split();
+  void ScanLoop();
+  bool ScanSubRange(SubRange const& sub_range);
+  // Runs |query| on the first replica of |sub_range| that answers and
+  // appends the rows that fit the packed format to |rows|. Paging goes by
+  // |*num_rows|, all rows returned, and |*last|, the key of the last one
+  // (untouched if there is none), since skipped rows count against the
+  // LIMIT too.
+  bool FetchPage(SubRange const& sub_range, std::string query,
+                 PackedMessageBatch* rows, size_t* num_rows, Message* last);
+  void Deliver(PackedMessageBatch const& rows);
+
+  RingCache* ring_cache_;
+  RowSink sink_;
+  int num_threads_;
+  int splits_per_range_;
+  int page_size_;
+  ConsistencyLevel::type consistency_;
+  std::deque<SubRange> sub_ranges_;
+  boost::mutex mutex_;  // guards sub_ranges_
+  boost::mutex sink_mutex_;
+  std::atomic<uint64_t> num_sub_ranges_;
+  std::atomic<uint64_t> num_failed_;
+  std::atomic<uint64_t> num_pages_;
+  std::atomic<uint64_t> num_rows_;
+};
+
+#endif // RANGE_SCANNER_H_
@@ -0,0 +1,120 @@
+#include "retry_policy.h"
+
+#include <algorithm>
+#include <functional>
+#include <random>
+#include <thread>
+
+namespace {
+
+// Every retry costs this many budget units.
+const int64_t kRetryCost = 1000;
+// The budget never holds more than this many retries, so a quiet period
+// can not bank an unbounded burst.
+const int64_t kMaxBankedRetries = 100;
+
+int64_t Jitter(int64_t bound) {
+  static thread_local std::minstd_rand random(
+      std::hash<std::thread::id>()(std::this_thread::get_id()));
+  return bound > 0 ? random() % (bound + 1) : 0;
+}
+
+}  // namespace
+
+RetryDecision NoRetryPolicy::OnFailure(int /* attempt */,
+                                       OfflineStatus::type /* status */,
+                                       ConsistencyLevel::type consistency) {
+  RetryDecision decision = { RetryDecision::FAIL, consistency, 0 };
+  return decision;
+}
+
+BackoffRetryPolicy::BackoffRetryPolicy(int max_retries,
+                                       int64_t base_backoff_us,
+                                       int64_t max_backoff_us,
+                                       double budget_ratio, bool downgrade)
+    : max_retries_(max_retries), base_backoff_us_(base_backoff_us),
+      max_backoff_us_(max_backoff_us),
+      budget_per_request_(static_cast<int64_t>(budget_ratio * kRetryCost)),
+      budget_cap_(kMaxBankedRetries * kRetryCost), downgrade_(downgrade),
+      budget_(kMaxBankedRetries * kRetryCost / 10) {
+}
+
+void BackoffRetryPolicy::OnRequest() {
+  int64_t old_budget = budget_.load();
+  int64_t new_budget;
+  do {
+    new_budget = std::min(budget_cap_, old_budget + budget_per_request_);
+  } while (!budget_.compare_exchange_weak(old_budget, new_budget));
+}
+
+RetryDecision BackoffRetryPolicy::OnFailure(
+    int attempt, OfflineStatus::type status,
+    ConsistencyLevel::type consistency) {
+  RetryDecision decision = { RetryDecision::FAIL, consistency, 0 };
+  if (status == OfflineStatus::INVALID || attempt >= max_retries_ ||
+      !WithdrawRetry())
+    return decision;
+
+  decision.action = RetryDecision::RETRY_NEXT_HOST;
+  if (status == OfflineStatus::UNAVAILABLE && downgrade_ &&
+      Downgrade(consistency) != consistency) {
+    decision.action = RetryDecision::RETRY_SAME_HOST;
+    decision.consistency = Downgrade(consistency);
+  }
+  int64_t cap = base_backoff_us_ << std::min(attempt, 20);
+  decision.backoff_us = Jitter(std::min(cap, max_backoff_us_));
+  return decision;
+}
+
+bool BackoffRetryPolicy::WithdrawRetry() {
+  int64_t old_budget = budget_.load();
+  do {
+    if (old_budget < kRetryCost)
+      return false;
+  } while (!budget_.compare_exchange_weak(old_budget,
+                                          old_budget - kRetryCost));
+  return true;
+}
+
+ConsistencyLevel::type BackoffRetryPolicy::Downgrade(
+    ConsistencyLevel::type consistency) {
+  switch (consistency) {
+    case ConsistencyLevel::ALL:
+      return ConsistencyLevel::QUORUM;
+    // ONE could be answered by a remote datacenter.
+    case ConsistencyLevel::LOCAL_QUORUM:
+      return ConsistencyLevel::LOCAL_ONE;
+    case ConsistencyLevel::EACH_QUORUM:
+    case ConsistencyLevel::QUORUM:
+    case ConsistencyLevel::THREE:
+    case ConsistencyLevel::TWO:
+      return ConsistencyLevel::ONE;
+    default:
+      return consistency;
+  }
+}
+
+bool ParseConsistencyLevel(std::string const& name,
+                           ConsistencyLevel::type* consistency) {
+  static const struct {
+    const char* name;
+    ConsistencyLevel::type level;
+  } kLevels[] = {
+    { "ONE", ConsistencyLevel::ONE },
+    { "LOCAL_ONE", ConsistencyLevel::LOCAL_ONE },
+    { "TWO", ConsistencyLevel::TWO },
+    { "THREE", ConsistencyLevel::THREE },
+    { "QUORUM", ConsistencyLevel::QUORUM },
+    { "LOCAL_QUORUM", ConsistencyLevel::LOCAL_QUORUM },
+    { "EACH_QUORUM", ConsistencyLevel::EACH_QUORUM },
+    { "ALL", ConsistencyLevel::ALL },
+    { "ANY", ConsistencyLevel::ANY },
+  };
+  for (size_t i = 0; i < sizeof(kLevels) / sizeof(kLevels[0]); ++i) {
+    if (name == kLevels[i].name) {
+      *consistency = kLevels[i].level;
+      return true;
+    }
+  }
+  return false;
+}
@@ -0,0 +1,82 @@
+#ifndef RETRY_POLICY_H_
+#define RETRY_POLICY_H_
+
+#include "Cassandra.h"
+
+#include <stdint.h>
+
+#include <atomic>
+#include <string>
+
+#include "offline_status.h"
+
+using namespace ::org::apache::cassandra;
+
+struct RetryDecision {
+  enum Action {
+    FAIL,             // give up and report the last status
+    RETRY_SAME_HOST,  // the replica of the failed attempt, e.g. at a
+                      // downgraded consistency level
+    RETRY_NEXT_HOST,  // another replica from the RingCache replica list
+  };
+  Action action;
+  ConsistencyLevel::type consistency;  // for the next attempt
+  int64_t backoff_us;                  // pause before the next attempt
+};
+
+// Decides what OfflineManager does after a failed attempt. Implementations
+// must be thread-safe.
+class RetryPolicy {
+ public:
+  virtual ~RetryPolicy() {}
+  // Called once for every new request, before its first attempt.
+  virtual void OnRequest() {}
+  // Called after attempt |attempt| (0 for the first) failed with |status|
+  // at |consistency|.
+  virtual RetryDecision OnFailure(int attempt, OfflineStatus::type status,
+                                  ConsistencyLevel::type consistency) = 0;
+};
+
+class NoRetryPolicy : public RetryPolicy {
+ public:
+  virtual RetryDecision OnFailure(int attempt, OfflineStatus::type status,
+                                  ConsistencyLevel::type consistency);
+};
+
+// Retries TIMEOUT, UNAVAILABLE and OVERLOADED on the next replica after an
+// exponential backoff with full jitter, at most |max_retries| times per
+// request. Retries are also bounded in total by a budget that every
+// request refills by |budget_ratio|, so a struggling cluster never sees
+// more than (1 + budget_ratio) times the offered load. With |downgrade|,
+// UNAVAILABLE retries at a weaker consistency level on the same host: the
+// coordinator answered, only too few replicas were alive for the level.
+class BackoffRetryPolicy : public RetryPolicy {
+ public:
+  BackoffRetryPolicy(int max_retries, int64_t base_backoff_us,
+                     int64_t max_backoff_us, double budget_ratio,
+                     bool downgrade);
+
+  virtual void OnRequest();
+  virtual RetryDecision OnFailure(int attempt, OfflineStatus::type status,
+                                  ConsistencyLevel::type consistency);
+
+  static ConsistencyLevel::type Downgrade(ConsistencyLevel::type consistency);
+
+ private:
+  bool WithdrawRetry();
+
+  int max_retries_;
+  int64_t base_backoff_us_;
+  int64_t max_backoff_us_;
+  int64_t budget_per_request_;  // in thousandths of a retry
+  int64_t budget_cap_;
+  bool downgrade_;
+  std::atomic<int64_t> budget_;
+};
+
+// Parses ONE, QUORUM, ... as spelled in the Thrift enum. Returns false for
+// unknown names.
+bool ParseConsistencyLevel(std::string const& name,
+                           ConsistencyLevel::type* consistency);
+
+#endif // RETRY_POLICY_H_
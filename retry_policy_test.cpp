@@ -0,0 +1,99 @@
+#include "retry_policy.h"
+
+#include <algorithm>
+
+#include "thirdparty/gtest/gtest.h"
+
+TEST(RetryPolicyTest, NoRetryPolicyFails) {
+  NoRetryPolicy policy;
+  RetryDecision decision =
+      policy.OnFailure(0, OfflineStatus::TIMEOUT, ConsistencyLevel::ONE);
+  EXPECT_EQ(RetryDecision::FAIL, decision.action);
+}
+
+TEST(RetryPolicyTest, RetriesOnNextHostWithBoundedBackoff) {
+  BackoffRetryPolicy policy(3, 1000, 5000, 0.1, false);
+  for (int attempt = 0; attempt < 3; ++attempt) {
+    policy.OnRequest();
+    RetryDecision decision = policy.OnFailure(
+        attempt, OfflineStatus::TIMEOUT, ConsistencyLevel::QUORUM);
+    EXPECT_EQ(RetryDecision::RETRY_NEXT_HOST, decision.action);
+    EXPECT_EQ(ConsistencyLevel::QUORUM, decision.consistency);
+    EXPECT_GE(decision.backoff_us, 0);
+    EXPECT_LE(decision.backoff_us, std::min<int64_t>(1000 << attempt, 5000));
+  }
+  EXPECT_EQ(RetryDecision::FAIL,
+            policy.OnFailure(3, OfflineStatus::TIMEOUT,
+                             ConsistencyLevel::QUORUM).action);
+}
+
+TEST(RetryPolicyTest, InvalidIsNeverRetried) {
+  BackoffRetryPolicy policy(3, 1000, 5000, 0.1, true);
+  EXPECT_EQ(RetryDecision::FAIL,
+            policy.OnFailure(0, OfflineStatus::INVALID,
+                             ConsistencyLevel::QUORUM).action);
+}
+
+TEST(RetryPolicyTest, UnavailableDowngradesOnSameHost) {
+  BackoffRetryPolicy policy(3, 1000, 5000, 0.1, true);
+  RetryDecision decision = policy.OnFailure(
+      0, OfflineStatus::UNAVAILABLE, ConsistencyLevel::QUORUM);
+  EXPECT_EQ(RetryDecision::RETRY_SAME_HOST, decision.action);
+  EXPECT_EQ(ConsistencyLevel::ONE, decision.consistency);
+
+  // Nothing weaker than ONE, so another replica is tried instead.
+  decision = policy.OnFailure(1, OfflineStatus::UNAVAILABLE,
+                              ConsistencyLevel::ONE);
+  EXPECT_EQ(RetryDecision::RETRY_NEXT_HOST, decision.action);
+  EXPECT_EQ(ConsistencyLevel::ONE, decision.consistency);
+}
+
+TEST(RetryPolicyTest, UnavailableWithoutDowngradeMovesOn) {
+  BackoffRetryPolicy policy(3, 1000, 5000, 0.1, false);
+  RetryDecision decision = policy.OnFailure(
+      0, OfflineStatus::UNAVAILABLE, ConsistencyLevel::ALL);
+  EXPECT_EQ(RetryDecision::RETRY_NEXT_HOST, decision.action);
+  EXPECT_EQ(ConsistencyLevel::ALL, decision.consistency);
+}
+
+TEST(RetryPolicyTest, BudgetBoundsRetries) {
+  BackoffRetryPolicy policy(1, 0, 0, 0.5, false);
+  // Whatever was banked at construction runs out, then every second
+  // request earns one retry.
+  int retries = 0;
+  for (int i = 0; i < 1000; ++i) {
+    if (policy.OnFailure(0, OfflineStatus::TIMEOUT,
+                         ConsistencyLevel::ONE).action != RetryDecision::FAIL)
+      ++retries;
+  }
+  EXPECT_LT(retries, 1000);
+  EXPECT_EQ(RetryDecision::FAIL,
+            policy.OnFailure(0, OfflineStatus::TIMEOUT,
+                             ConsistencyLevel::ONE).action);
+  policy.OnRequest();
+  EXPECT_EQ(RetryDecision::FAIL,
+            policy.OnFailure(0, OfflineStatus::TIMEOUT,
+                             ConsistencyLevel::ONE).action);
+  policy.OnRequest();
+  EXPECT_EQ(RetryDecision::RETRY_NEXT_HOST,
+            policy.OnFailure(0, OfflineStatus::TIMEOUT,
+                             ConsistencyLevel::ONE).action);
+}
+
+TEST(RetryPolicyTest, DowngradeAndParse) {
+  EXPECT_EQ(ConsistencyLevel::QUORUM,
+            BackoffRetryPolicy::Downgrade(ConsistencyLevel::ALL));
+  EXPECT_EQ(ConsistencyLevel::LOCAL_ONE,
+            BackoffRetryPolicy::Downgrade(ConsistencyLevel::LOCAL_QUORUM));
+  EXPECT_EQ(ConsistencyLevel::LOCAL_ONE,
+            BackoffRetryPolicy::Downgrade(ConsistencyLevel::LOCAL_ONE));
+  EXPECT_EQ(ConsistencyLevel::ONE,
+            BackoffRetryPolicy::Downgrade(ConsistencyLevel::EACH_QUORUM));
+  EXPECT_EQ(ConsistencyLevel::ANY,
+            BackoffRetryPolicy::Downgrade(ConsistencyLevel::ANY));
+
+  ConsistencyLevel::type consistency;
+  ASSERT_TRUE(ParseConsistencyLevel("LOCAL_QUORUM", &consistency));
+  EXPECT_EQ(ConsistencyLevel::LOCAL_QUORUM, consistency);
+  EXPECT_FALSE(ParseConsistencyLevel("local_quorum", &consistency));
+}
@@ -2,6 +2,10 @@
 
 #include <stdlib.h>
 
+#include <algorithm>
+#include <utility>
+
+#include "common/base/timestamp.h"
 #include "lock_guard.h"
 #include "murmurhash3.h"
 #include "thirdparty/boost/thread/shared_lock_guard.hpp"
@@ -12,10 +16,22 @@
 
 DEFINE_string(seed_node_ip, "127.0.0.1",
              "Server node for client to fetch the ring information");
+DECLARE_string(cass_keyspace);
+DEFINE_int32(pool_warm_up_timeout_ms, 10000,
+             "Time allowed for opening the initial pool connections");
+DEFINE_string(local_dc, "",
+              "Datacenter whose replicas are preferred, the seed node's if "
+              "empty");
+DEFINE_string(local_rack, "",
+              "Rack of the local datacenter whose replicas are preferred");
+DEFINE_int32(remote_dc_cass_clients, 1,
+             "Connections warmed up per host in remote datacenters");
+DEFINE_int32(host_down_ms, 5000,
+             "Time a host is avoided after a connection to it failed");
 
 using namespace ::apache::thrift::protocol;
 
-RingCache::RingCache() {
+RingCache::RingCache(int pool_size) : pool_size_(pool_size), ready_(false) {
   InitRefreshClient();
   RefreshEndpointMap();
   RefreshClientPools();
@@ -24,7 +40,8 @@ RingCache::RingCache() {
 void RingCache::InitRefreshClient() {
   try {
     boost::shared_ptr<TTransport> socket =
-        boost::shared_ptr<TSocket>(new TSocket(FLAGS_seed_node_ip, 9160));
+        boost::shared_ptr<TSocket>(new TSocket(
+            FLAGS_seed_node_ip, CassClientPool::PortFor(FLAGS_seed_node_ip)));
     refresh_transport_ = boost::shared_ptr<TFramedTransport>(
         new TFramedTransport(socket));
     boost::shared_ptr<TProtocol> protocol = boost::shared_ptr<TBinaryProtocol>(
@@ -37,19 +54,45 @@ void RingCache::InitRefreshClient() {
 }
 
 RingCache::~RingCache() {
+  // Stops the warm-up threads, which call back into this object.
+  Drain(GetTimeStampInMs());
   refresh_transport_->close();
 }
 
 void RingCache::RefreshEndpointMap() {
   try {
-    std::string keyspace = "offline_keyspace";
     std::vector<TokenRange> ring;
     //describe_ring return both normal and down nodes!!
-    refresh_client_->describe_ring(ring, keyspace);
+    refresh_client_->describe_ring(ring, FLAGS_cass_keyspace);
+    // Placement of every host, from endpoint_details; hosts without details
+    // count as local.
+    std::unordered_map<std::string, EndpointDetails> details;
+    for (auto& range : ring) {
+      for (auto& endpoint : range.endpoint_details)
+        details[endpoint.host] = endpoint;
+    }
+    std::string local_dc = FLAGS_local_dc;
+    if (local_dc.empty()) {
+      if (details.count(FLAGS_seed_node_ip)) {
+        local_dc = details[FLAGS_seed_node_ip].datacenter;
+      } else if (!details.empty()) {
+        // endpoint_details are keyed by listen address, which differs from
+        // the RPC address of the seed on multi-homed nodes.
+        LOG_FIRST_N(WARNING, 1)
+            << "Seed node " << FLAGS_seed_node_ip << " is not among the "
+            << "ring's endpoints, set --local_dc for datacenter-aware "
+            << "routing";
+      }
+    }
+
     LockGuard<boost::shared_mutex> lock(shared_mutex_);
     range_map_.clear();
     round_pos_.clear();
     cass_servers_.clear();
+    host_tiers_.clear();
+    if (local_dc != local_dc_ && !local_dc.empty())
+      LOG(INFO) << "Preferring replicas in datacenter " << local_dc;
+    local_dc_ = local_dc;
     for (auto& range : ring) {
       int64_t left = strtoll(range.start_token.c_str(), NULL, 10);
       int64_t right = strtoll(range.end_token.c_str(), NULL, 10);
@@ -59,6 +102,20 @@ void RingCache::RefreshEndpointMap() {
         range_map_.insert(
             std::pair<boost::shared_ptr<Range>,std::string>(r, host));
         cass_servers_.insert(host);
+        Tier tier = LOCAL_DC;
+        auto detail = details.find(host);
+        if (detail != details.end()) {
+          if (!local_dc.empty() && detail->second.datacenter != local_dc)
+            tier = REMOTE_DC;
+          else if (!FLAGS_local_rack.empty() &&
+                   detail->second.rack == FLAGS_local_rack)
+            tier = LOCAL_RACK;
+        }
+        host_tiers_[host] = tier;
+        if (!down_until_.count(host)) {
+          down_until_[host] = boost::shared_ptr<std::atomic<int64_t>>(
+              new std::atomic<int64_t>(0));
+        }
       }
       round_pos_.push_back(boost::shared_ptr<std::atomic<size_t>>(
                                new std::atomic<size_t>(0)));
@@ -69,38 +126,262 @@ void RingCache::RefreshEndpointMap() {
 }
 
 void RingCache::RefreshClientPools() {
-  LockGuard<boost::shared_mutex> lock(shared_mutex_);
-  for (auto it = cass_servers_.begin(); it != cass_servers_.end(); ++it) {
-    boost::shared_ptr<CassClientPool> pool =
-        boost::shared_ptr<CassClientPool>(new CassClientPool(*it));
-    client_pools_.insert(
-        std::pair<std::string, boost::shared_ptr<CassClientPool>>(*it, pool));
+  std::vector<boost::shared_ptr<CassClientPool>> new_pools;
+  {
+    LockGuard<boost::shared_mutex> lock(shared_mutex_);
+    for (auto it = cass_servers_.begin(); it != cass_servers_.end(); ++it) {
+      if (client_pools_.count(*it))
+        continue;
+      // Remote hosts are only a fallback, so they keep few connections;
+      // more are opened on demand if the local replicas go down.
+      int pool_size = TierOf(*it) == REMOTE_DC ? FLAGS_remote_dc_cass_clients
+                                               : pool_size_;
+      boost::shared_ptr<CassClientPool> pool =
+          boost::shared_ptr<CassClientPool>(
+              new CassClientPool(*it, pool_size));
+      client_pools_.insert(
+          std::pair<std::string, boost::shared_ptr<CassClientPool>>(*it, pool));
+      new_pools.push_back(pool);
+    }
+  }
+  if (!new_pools.empty()) {
+    LockGuard<boost::mutex> lock(warm_up_mutex_);
+    warm_up_threads_.push_back(
+        new boost::thread(&RingCache::WarmUpPools, this, new_pools));
+  }
+}
+
+void RingCache::WarmUpPools(
+    std::vector<boost::shared_ptr<CassClientPool>> pools) {
+  // |pools| keeps the pools alive even if they are dropped from
+  // client_pools_ meanwhile.
+  std::vector<CassClientPool*> raw_pools;
+  for (size_t i = 0; i < pools.size(); ++i)
+    raw_pools.push_back(pools[i].get());
+  CassClientPool::WarmUp(raw_pools, FLAGS_pool_warm_up_timeout_ms,
+                         std::tr1::bind(&RingCache::OnLiveConnection, this,
+                                        std::tr1::placeholders::_1));
+}
+
+void RingCache::OnLiveConnection(CassClientPool* pool) {
+  boost::shared_lock_guard<boost::shared_mutex> shared_lock(shared_mutex_);
+  LockGuard<boost::mutex> lock(ready_mutex_);
+  if (!live_servers_.insert(pool->cass_server_).second || ready_)
+    return;
+  if (IsReadyLocked()) {
+    ready_ = true;
+    ready_cond_.notify_all();
+  }
+}
+
+// Requires shared_mutex_ and ready_mutex_.
+bool RingCache::IsReadyLocked() {
+  for (auto it = range_map_.begin(); it != range_map_.end();
+       it = range_map_.upper_bound(it->first)) {
+    bool live = false;
+    auto replicas = range_map_.equal_range(it->first);
+    for (auto r = replicas.first; r != replicas.second && !live; ++r)
+      live = live_servers_.count(r->second) > 0;
+    if (!live)
+      return false;
+  }
+  return !range_map_.empty();
+}
+
+bool RingCache::WaitUntilReady(int timeout_ms) {
+  boost::unique_lock<boost::mutex> lock(ready_mutex_);
+  boost::chrono::steady_clock::time_point deadline =
+      boost::chrono::steady_clock::now() +
+      boost::chrono::milliseconds(timeout_ms);
+  while (!ready_) {
+    if (ready_cond_.wait_until(lock, deadline) == boost::cv_status::timeout)
+      return ready_;
   }
+  return true;
 }
 
-CassClientPool::Node* RingCache::GetClientNode(std::string row_key) {
+CassClientPool::Node* RingCache::GetClientNode(
+    std::string row_key, int64_t deadline_ms,
+    std::string const& exclude_server, bool* shed,
+    std::string* tried_server) {
   const char* byte = row_key.c_str();
   int64_t hash[2];
   MurmurHash3_x64_128(byte, row_key.size(), 0, hash);
-  int64_t token = hash[0];
+  ReplicaList replicas;
+  OrderReplicas(hash[0], exclude_server, &replicas);
+  // Waiting for a limiter slot or a connect must not hold shared_mutex_: a
+  // queued RefreshEndpointMap would block the returns that free the slots.
+  for (size_t i = 0; i < replicas.size(); ++i) {
+    if (tried_server != NULL)
+      *tried_server = replicas[i].first;
+    bool overloaded = false;
+    bool host_down = false;
+    CassClientPool::Node* node =
+        replicas[i].second->AcquireNode(deadline_ms, &overloaded, &host_down);
+    if (node != NULL)
+      return node;
+    if (overloaded) {
+      if (shed != NULL)
+        *shed = true;
+      return NULL;
+    }
+    if (deadline_ms > 0 && GetTimeStampInMs() >= deadline_ms)
+      return NULL;
+    // A draining pool or a limiter wait says nothing about the host; only
+    // a refused or closed connect does, as in DiscardClientNode.
+    if (host_down) {
+      boost::shared_lock_guard<boost::shared_mutex> shared_lock(
+          shared_mutex_);
+      MarkDown(replicas[i].first);
+    }
+  }
+  return NULL;
+}
+
+void RingCache::OrderReplicas(int64_t token,
+                              std::string const& exclude_server,
+                              ReplicaList* replicas) {
   int round_index = 0;
+  int64_t now = GetTimeStampInMs();
   boost::shared_lock_guard<boost::shared_mutex> shared_lock(shared_mutex_);
   for (auto it = range_map_.begin(); it != range_map_.end();
        it = range_map_.upper_bound(it->first)) {
     if (it->first->Contain(token)) {
-      size_t bound = range_map_.count(it->first);
-      int pos = GetRoundPos(round_index, bound);
-      for (int i = 0; i < pos; ++i)
-        ++it;
-      return client_pools_[it->second]->AcquireNode();
+      // Ranked by tier, down replicas after every one that is up and the
+      // excluded one last.
+      std::vector<std::pair<int, std::string const*>> ranked;
+      auto range = range_map_.equal_range(it->first);
+      for (auto r = range.first; r != range.second; ++r) {
+        int rank = TierOf(r->second);
+        if (r->second == exclude_server)
+          rank += 2 * (REMOTE_DC + 1);
+        else if (IsDown(r->second, now))
+          rank += REMOTE_DC + 1;
+        ranked.push_back(std::make_pair(rank, &r->second));
+      }
+      if (ranked.empty())
+        return;
+      std::stable_sort(ranked.begin(), ranked.end(),
+                       [](std::pair<int, std::string const*> const& a,
+                          std::pair<int, std::string const*> const& b) {
+                         return a.first < b.first;
+                       });
+      // Round-robin among the replicas of the best rank.
+      size_t nearest = 1;
+      while (nearest < ranked.size() &&
+             ranked[nearest].first == ranked[0].first)
+        ++nearest;
+      std::rotate(ranked.begin(),
+                  ranked.begin() + GetRoundPos(round_index, nearest),
+                  ranked.begin() + nearest);
+      for (size_t i = 0; i < ranked.size(); ++i) {
+        auto pool = client_pools_.find(*ranked[i].second);
+        if (pool != client_pools_.end())
+          replicas->push_back(std::make_pair(pool->first, pool->second));
+      }
+      return;
     }
     ++round_index;
   }
 }
 
-void RingCache::ReturnClientNode(CassClientPool::Node* node) {
+CassClientPool::Node* RingCache::GetServerNode(std::string const& server,
+                                              int64_t deadline_ms,
+                                              bool* shed) {
+  boost::shared_ptr<CassClientPool> pool;
+  {
+    boost::shared_lock_guard<boost::shared_mutex> shared_lock(shared_mutex_);
+    auto found = client_pools_.find(server);
+    if (found == client_pools_.end())
+      return NULL;
+    pool = found->second;
+  }
+  return pool->AcquireNode(deadline_ms, shed);
+}
+
+void RingCache::GetRingRanges(std::vector<RingRange>* ranges) {
+  ranges->clear();
+  boost::shared_lock_guard<boost::shared_mutex> shared_lock(shared_mutex_);
+  for (auto it = range_map_.begin(); it != range_map_.end();
+       it = range_map_.upper_bound(it->first)) {
+    RingRange range;
+    range.left = it->first->left();
+    range.right = it->first->right();
+    auto replicas = range_map_.equal_range(it->first);
+    for (auto r = replicas.first; r != replicas.second; ++r)
+      range.replicas.push_back(r->second);
+    ranges->push_back(range);
+  }
+}
+
+void RingCache::ReturnClientNode(CassClientPool::Node* node,
+                                 bool timed_out) {
+  boost::shared_lock_guard<boost::shared_mutex> shared_lock(shared_mutex_);
+  // last_rtt_us is only set by a request that got its reply.
+  if (node->last_rtt_us > 0)
+    MarkUp(node->cass_server);
+  client_pools_[node->cass_server]->ReturnNode(node, timed_out);
+}
+
+void RingCache::DiscardClientNode(CassClientPool::Node* node,
+                                  bool host_down) {
   boost::shared_lock_guard<boost::shared_mutex> shared_lock(shared_mutex_);
-  client_pools_[node->cass_server]->ReturnNode(node);
+  if (host_down)
+    MarkDown(node->cass_server);
+  client_pools_[node->cass_server]->DiscardNode(node);
+}
+
+RingCache::Tier RingCache::TierOf(std::string const& host) {
+  auto it = host_tiers_.find(host);
+  return it == host_tiers_.end() ? LOCAL_DC : it->second;
+}
+
+bool RingCache::IsDown(std::string const& host, int64_t now_ms) {
+  auto it = down_until_.find(host);
+  return it != down_until_.end() && it->second->load() > now_ms;
+}
+
+void RingCache::MarkDown(std::string const& host) {
+  auto it = down_until_.find(host);
+  if (it != down_until_.end())
+    it->second->store(GetTimeStampInMs() + FLAGS_host_down_ms);
+}
+
+void RingCache::MarkUp(std::string const& host) {
+  auto it = down_until_.find(host);
+  if (it != down_until_.end() && it->second->load() != 0)
+    it->second->store(0);
+}
+
+bool RingCache::Drain(int64_t deadline_ms) {
+  std::vector<boost::shared_ptr<CassClientPool>> pools;
+  {
+    boost::shared_lock_guard<boost::shared_mutex> shared_lock(shared_mutex_);
+    for (auto it = client_pools_.begin(); it != client_pools_.end(); ++it)
+      pools.push_back(it->second);
+  }
+  bool drained = true;
+  for (size_t i = 0; i < pools.size(); ++i)
+    drained = pools[i]->Drain(deadline_ms) && drained;
+  // Warm-ups give up on draining pools within a poll slice.
+  std::vector<boost::thread*> warm_ups;
+  {
+    LockGuard<boost::mutex> lock(warm_up_mutex_);
+    warm_ups.swap(warm_up_threads_);
+  }
+  for (size_t i = 0; i < warm_ups.size(); ++i) {
+    warm_ups[i]->join();
+    delete warm_ups[i];
+  }
+  std::vector<boost::thread*> closers;
+  for (size_t i = 0; i < pools.size(); ++i)
+    closers.push_back(
+        new boost::thread(&CassClientPool::CloseIdle, pools[i].get()));
+  for (size_t i = 0; i < closers.size(); ++i) {
+    closers[i]->join();
+    delete closers[i];
+  }
+  return drained;
 }
 
 size_t RingCache::GetRoundPos(int round_index, size_t bound) {
@@ -4,8 +4,10 @@
 #include "Cassandra.h"
 
 #include <stddef.h>
+#include <stdint.h>
 #include <atomic>
 #include <map>
+#include <string>
 #include <unordered_map>
 #include <unordered_set>
 #include <vector>
@@ -18,30 +20,105 @@ using namespace ::apache::thrift;
 using namespace ::apache::thrift::transport;
 using namespace ::org::apache::cassandra;
 
+// A token range (left, right] of the ring and the hosts replicating it.
+struct RingRange {
+  int64_t left;
+  int64_t right;
+  std::vector<std::string> replicas;
+};
+
 class RingCache {
  public:
   static RingCache& GetInstance() {
     static RingCache instance;
     return instance;
   }
+  // A private ring cache with its own routing snapshot and pools of
+  // |pool_size| connections per host (--num_cass_clients if 0), for
+  // callers that must not share the process-wide instance.
+  explicit RingCache(int pool_size = 0);
   ~RingCache();
   void RefreshEndpointMap();
+  // Creates pools for hosts that do not have one yet and warms them up in
+  // the background.
   void RefreshClientPools();
-  CassClientPool::Node* GetClientNode(std::string row_key);
-  void ReturnClientNode(CassClientPool::Node* node);
+  // Blocks until every token range has at least one replica with a live
+  // connection, or |timeout_ms| passes. Returns whether the ring is ready.
+  bool WaitUntilReady(int timeout_ms);
+  // Returns NULL if no replica of |row_key| has a usable connection before
+  // |deadline_ms| (0 means no deadline). Replicas are tried nearest first:
+  // the local rack (--local_rack), then the local datacenter, then remote
+  // ones, round-robin among the nearest; replicas marked down come after
+  // all that are up, and |exclude_server| comes last. A replica that
+  // refuses or closes the connect is marked down; either way the next one
+  // is tried. |*shed| is set to true when a replica refused the request
+  // because it is overloaded, and |*tried_server| to the last replica
+  // tried.
+  CassClientPool::Node* GetClientNode(std::string row_key,
+                                      int64_t deadline_ms = 0,
+                                      std::string const& exclude_server = "",
+                                      bool* shed = NULL,
+                                      std::string* tried_server = NULL);
+  // Like GetClientNode, but from the pool of |server| itself. Returns NULL
+  // if |server| has no pool or no usable connection.
+  CassClientPool::Node* GetServerNode(std::string const& server,
+                                      int64_t deadline_ms = 0,
+                                      bool* shed = NULL);
+  // Copies the current token ranges and their replicas into |ranges|.
+  void GetRingRanges(std::vector<RingRange>* ranges);
+  // |timed_out| as for CassClientPool::ReturnNode. A node that completed a
+  // request also marks its host up again.
+  void ReturnClientNode(CassClientPool::Node* node, bool timed_out = false);
+  // With |host_down|, for connections the host refused or closed, also
+  // marks the node's host down for --host_down_ms. A request that merely
+  // ran out of time says nothing about the host.
+  void DiscardClientNode(CassClientPool::Node* node, bool host_down);
+  // Stops handing out connections, waits until |deadline_ms| for the ones
+  // in use to be returned, then closes every pool, all hosts in parallel.
+  // Returns whether no connection was still in use.
+  bool Drain(int64_t deadline_ms);
 
  private:
-  RingCache();
+  enum Tier { LOCAL_RACK = 0, LOCAL_DC = 1, REMOTE_DC = 2 };
+
   void InitRefreshClient();
+  // These require shared_mutex_, shared or exclusive.
+  Tier TierOf(std::string const& host);
+  bool IsDown(std::string const& host, int64_t now_ms);
+  void MarkDown(std::string const& host);
+  void MarkUp(std::string const& host);
+  typedef std::vector<std::pair<std::string,
+                                boost::shared_ptr<CassClientPool>>>
+      ReplicaList;
+  // Puts the replicas of |token| that have a pool into |replicas| in the
+  // order GetClientNode tries them, taking shared_mutex_ itself.
+  void OrderReplicas(int64_t token, std::string const& exclude_server,
+                     ReplicaList* replicas);
   size_t GetRoundPos(int round_index, size_t bound);
+  void WarmUpPools(std::vector<boost::shared_ptr<CassClientPool>> pools);
+  void OnLiveConnection(CassClientPool* pool);
+  bool IsReadyLocked();
   boost::shared_ptr<CassandraClient> refresh_client_;
   boost::shared_ptr<TTransport> refresh_transport_;
   std::multimap<boost::shared_ptr<Range>, std::string> range_map_;
   std::vector<boost::shared_ptr<std::atomic<size_t>>> round_pos_;
   std::unordered_set<std::string> cass_servers_;
+  std::string local_dc_;  // to log only when it changes
+  std::unordered_map<std::string, Tier> host_tiers_;
+  // Time until which a host is skipped, kept across refreshes.
+  std::unordered_map<std::string,
+                     boost::shared_ptr<std::atomic<int64_t>>> down_until_;
   std::unordered_map<std::string,
                      boost::shared_ptr<CassClientPool>> client_pools_;
   boost::shared_mutex shared_mutex_;
+  int pool_size_;
+  std::unordered_set<std::string> live_servers_;
+  bool ready_;
+  boost::mutex ready_mutex_;  // guards live_servers_ and ready_
+  boost::condition_variable ready_cond_;
+  // Joined by Drain, so none outlives this object.
+  std::vector<boost::thread*> warm_up_threads_;
+  boost::mutex warm_up_mutex_;  // guards warm_up_threads_
 };
 
 #endif // RING_CACHE_H_
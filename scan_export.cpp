@@ -0,0 +1,118 @@
+#include "Cassandra.h"
+
+#include <stdio.h>
+
+#include <algorithm>
+#include <string>
+
+#include "common/base/timestamp.h"
+#include "message_codec.h"
+#include "range_scanner.h"
+#include "retry_policy.h"
+#include "ring_cache.h"
+#include "thirdparty/gflags/gflags.h"
+#include "thirdparty/glog/logging.h"
+
+DEFINE_string(scan_output, "-",
+              "File to export receiver_table to, - for stdout");
+DEFINE_string(scan_format, "csv",
+              "csv, or binary for length-prefixed records readable with "
+              "DecodeMessage");
+DEFINE_int32(scan_threads, 16, "Number of concurrent sub-range scans");
+DEFINE_int32(scan_splits_per_range, 4,
+             "Sub-ranges each token range is split into");
+DEFINE_int32(scan_page_size, 1000, "Rows fetched per query");
+DEFINE_string(scan_consistency, "ONE", "Consistency level of the scan");
+
+namespace {
+
+// Quotes |field| as RFC 4180 requires.
+void AppendCsvField(std::string const& field, std::string* out) {
+  if (field.find_first_of(",\"\r\n") == std::string::npos) {
+    out->append(field);
+    return;
+  }
+  out->push_back('"');
+  for (size_t i = 0; i < field.size(); ++i) {
+    if (field[i] == '"')
+      out->push_back('"');
+    out->push_back(field[i]);
+  }
+  out->push_back('"');
+}
+
+void WriteRows(FILE* output, bool csv, PackedMessageBatch const& rows) {
+  std::string buffer;
+  Message message;
+  for (size_t i = 0; i < rows.size(); ++i) {
+    rows.Get(i, &message);
+    if (csv) {
+      AppendCsvField(message.receiver_id, &buffer);
+      buffer.push_back(',');
+      AppendCsvField(message.timestamp, &buffer);
+      buffer.push_back(',');
+      AppendCsvField(message.msg_id, &buffer);
+      buffer.push_back(',');
+      AppendCsvField(message.group_id, &buffer);
+      buffer.push_back(',');
+      AppendCsvField(message.msg, &buffer);
+      buffer.push_back(',');
+      AppendCsvField(message.sender_id, &buffer);
+      buffer.push_back('\n');
+    } else {
+      EncodeMessage(message, &buffer);
+    }
+  }
+  if (fwrite(buffer.data(), 1, buffer.size(), output) != buffer.size())
+    PLOG(FATAL) << "Failed to write " << FLAGS_scan_output;
+}
+
+}  // namespace
+
+int main(int argc, char** argv) {
+  google::InitGoogleLogging(argv[0]);
+  google::ParseCommandLineFlags(&argc, &argv, false);
+
+  bool csv = FLAGS_scan_format == "csv";
+  if (!csv && FLAGS_scan_format != "binary") {
+    LOG(ERROR) << "Unknown --scan_format " << FLAGS_scan_format;
+    return 1;
+  }
+  ConsistencyLevel::type consistency;
+  if (!ParseConsistencyLevel(FLAGS_scan_consistency, &consistency)) {
+    LOG(ERROR) << "Unknown --scan_consistency " << FLAGS_scan_consistency;
+    return 1;
+  }
+  FILE* output = FLAGS_scan_output == "-" ?
+      stdout : fopen(FLAGS_scan_output.c_str(), "wb");
+  if (output == NULL)
+    PLOG(FATAL) << "Failed to open " << FLAGS_scan_output;
+  setvbuf(output, NULL, _IOFBF, 1 << 20);
+  if (csv)
+    fputs("receiver_id,ts,msg_id,group_id,msg,sender_id\n", output);
+
+  RingCache* ring_cache = &RingCache::GetInstance();
+  if (!ring_cache->WaitUntilReady(10000))
+    LOG(WARNING) << "Not every token range has a live replica yet";
+
+  int64_t begin_time = GetTimeStampInMs();
+  RangeScanner scanner(
+      ring_cache,
+      [=](PackedMessageBatch const& rows) { WriteRows(output, csv, rows); },
+      FLAGS_scan_threads, FLAGS_scan_splits_per_range, FLAGS_scan_page_size,
+      consistency);
+  bool complete = scanner.Scan();
+  if (fflush(output) != 0)
+    PLOG(FATAL) << "Failed to write " << FLAGS_scan_output;
+  if (output != stdout)
+    fclose(output);
+  int64_t elapsed_ms = std::max<int64_t>(GetTimeStampInMs() - begin_time, 1);
+
+  RangeScanner::Stats stats;
+  scanner.GetStats(&stats);
+  LOG(INFO) << "Sub-ranges: " << stats.sub_ranges
+            << ", failed: " << stats.failed_sub_ranges;
+  LOG(INFO) << "Rows: " << stats.rows << " in " << stats.pages << " pages";
+  LOG(INFO) << "Rows per second: " << stats.rows * 1000 / elapsed_ms;
+  return complete ? 0 : 2;
+}
@@ -0,0 +1,170 @@
+#include "spill_log.h"
+
+#include <stdint.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "lock_guard.h"
+#include "message_codec.h"
+#include "thirdparty/gflags/gflags.h"
+#include "thirdparty/glog/logging.h"
+#include "thirdparty/zlib/zlib.h"
+
+DEFINE_bool(spill_log_sync, true,
+            "fdatasync the spill log after every append; without it a host "
+            "crash loses the spilled messages not yet written back");
+
+namespace {
+
+// Far above any message the server accepts; a larger length can only come
+// from a corrupt header.
+const uint32_t kMaxRecordSize = 64 << 20;
+
+void PutUint32(uint32_t value, char* out) {
+  for (int i = 0; i < 4; ++i)
+    out[i] = static_cast<char>((value >> (8 * i)) & 0xff);
+}
+
+uint32_t GetUint32(const char* in) {
+  const unsigned char* p = reinterpret_cast<const unsigned char*>(in);
+  return p[0] | (p[1] << 8) | (p[2] << 16) |
+         (static_cast<uint32_t>(p[3]) << 24);
+}
+
+uint32_t Checksum(std::string const& payload) {
+  return crc32(crc32(0L, Z_NULL, 0),
+               reinterpret_cast<const Bytef*>(payload.data()), payload.size());
+}
+
+// Reads the next record of |file| into |message|. Returns false at the end
+// of the file or at the first truncated or corrupt record.
+bool ReadRecord(FILE* file, Message* message) {
+  char header[8];
+  if (fread(header, 1, sizeof(header), file) != sizeof(header))
+    return false;
+  uint32_t size = GetUint32(header);
+  // Checked before allocating, a torn or corrupt header could ask for
+  // gigabytes otherwise.
+  struct stat st;
+  long offset = ftell(file);
+  if (size > kMaxRecordSize ||
+      (fstat(fileno(file), &st) == 0 && offset >= 0 &&
+       size > st.st_size - offset)) {
+    LOG(ERROR) << "Bad spill log record length " << size
+               << ", dropping the tail";
+    return false;
+  }
+  std::string payload(size, '\0');
+  if (size > 0 && fread(&payload[0], 1, size, file) != size) {
+    LOG(ERROR) << "Truncated spill log record, dropping the tail";
+    return false;
+  }
+  if (Checksum(payload) != GetUint32(header + 4)) {
+    LOG(ERROR) << "Spill log checksum mismatch, dropping the tail";
+    return false;
+  }
+  const char* pos = payload.data();
+  return DecodeMessage(&pos, pos + payload.size(), message);
+}
+
+}  // namespace
+
+SpillLog::SpillLog(std::string const& path)
+    : path_(path), replay_path_(path + ".replay"), has_data_(false) {
+  file_ = fopen(path_.c_str(), "ab");
+  if (file_ == NULL) {
+    PLOG(ERROR) << "Can not open spill log " << path_;
+    return;
+  }
+  // Either a previous run left messages behind or it crashed mid-replay.
+  has_data_ = ftell(file_) > 0 || access(replay_path_.c_str(), F_OK) == 0;
+}
+
+SpillLog::~SpillLog() {
+  if (file_ != NULL)
+    fclose(file_);
+}
+
+bool SpillLog::Append(std::vector<Message> const& msgs) {
+  LockGuard<boost::mutex> lock(mutex_);
+  return AppendLocked(msgs);
+}
+
+bool SpillLog::AppendLocked(std::vector<Message> const& msgs) {
+  if (file_ == NULL)
+    return false;
+  std::string record;
+  std::string payload;
+  char header[8];
+  for (size_t i = 0; i < msgs.size(); ++i) {
+    payload.clear();
+    EncodeMessage(msgs[i], &payload);
+    PutUint32(payload.size(), header);
+    PutUint32(Checksum(payload), header + 4);
+    record.append(header, sizeof(header));
+    record.append(payload);
+  }
+  if (fwrite(record.data(), 1, record.size(), file_) != record.size() ||
+      fflush(file_) != 0) {
+    PLOG(ERROR) << "Write to spill log " << path_ << " failed";
+    return false;
+  }
+  if (FLAGS_spill_log_sync)
+    fdatasync(fileno(file_));
+  has_data_ = true;
+  return true;
+}
+
+size_t SpillLog::Replay(
+    std::tr1::function<bool(std::vector<Message> const&)> sink,
+    size_t batch_size) {
+  boost::unique_lock<boost::mutex> replay_lock(replay_mutex_,
+                                               boost::try_to_lock);
+  if (!replay_lock.owns_lock())
+    return 0;
+
+  {
+    // Move the live log aside so producers keep appending to a fresh file
+    // while it is being replayed. A leftover .replay from a crash is
+    // replayed first; the live log is picked up by the next call.
+    LockGuard<boost::mutex> lock(mutex_);
+    if (access(replay_path_.c_str(), F_OK) != 0) {
+      if (file_ != NULL)
+        fclose(file_);
+      if (rename(path_.c_str(), replay_path_.c_str()) != 0)
+        PLOG(ERROR) << "Can not rename spill log " << path_;
+      file_ = fopen(path_.c_str(), "ab");
+    }
+    has_data_ = false;
+  }
+
+  FILE* replay = fopen(replay_path_.c_str(), "rb");
+  if (replay == NULL)
+    return 0;
+  size_t replayed = 0;
+  bool rejected = false;
+  Message message;
+  std::vector<Message> batch;
+  for (bool more = true; more; ) {
+    more = ReadRecord(replay, &message);
+    if (more)
+      batch.push_back(message);
+    if (batch.empty() || (more && batch.size() < batch_size))
+      continue;
+    if (!rejected && sink(batch)) {
+      replayed += batch.size();
+    } else {
+      rejected = true;
+      Append(batch);
+    }
+    batch.clear();
+  }
+  fclose(replay);
+  unlink(replay_path_.c_str());
+  {
+    LockGuard<boost::mutex> lock(mutex_);
+    has_data_ = has_data_ || (file_ != NULL && ftell(file_) > 0);
+  }
+  LOG(INFO) << "Replayed " << replayed << " messages from " << path_;
+  return replayed;
+}
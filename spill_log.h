@@ -0,0 +1,42 @@
+#ifndef SPILL_LOG_H_
+#define SPILL_LOG_H_
+
+#include <stdio.h>
+
+#include <atomic>
+#include <string>
+#include <vector>
+
+#include "common/idl/message_types.h"
+#include "thirdparty/boost/thread.hpp"
+
+// Append-only local log of messages that could not be written to
+// Cassandra. Every record is a 4-byte length, a 4-byte CRC32 of the
+// payload and an EncodeMessage payload, so a torn tail left by a crash is
+// detected and ignored on replay.
+class SpillLog {
+ public:
+  explicit SpillLog(std::string const& path);
+  ~SpillLog();
+
+  bool Append(std::vector<Message> const& msgs);
+  bool HasData() { return has_data_.load(); }
+  // Hands the logged messages to |sink| in batches of at most |batch_size|.
+  // Once |sink| rejects a batch, that batch and everything after it is
+  // written back to the log for a later replay. Returns the number of
+  // messages accepted by |sink|. Concurrent calls return 0 immediately.
+  size_t Replay(std::tr1::function<bool(std::vector<Message> const&)> sink,
+                size_t batch_size);
+
+ private:
+  bool AppendLocked(std::vector<Message> const& msgs);
+
+  std::string path_;
+  std::string replay_path_;
+  FILE* file_;
+  std::atomic<bool> has_data_;
+  boost::mutex mutex_;  // guards file_
+  boost::mutex replay_mutex_;
+};
+
+#endif // SPILL_LOG_H_
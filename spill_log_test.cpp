@@ -0,0 +1,174 @@
+#include "spill_log.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include <string>
+#include <vector>
+
+#include "test_message.h"
+#include "thirdparty/gtest/gtest.h"
+
+namespace {
+
+std::vector<Message> OneMessage(int i) {
+  return std::vector<Message>(1, MakeTestMessage("receiver", i));
+}
+
+class SpillLogTest : public testing::Test {
+ protected:
+  virtual void SetUp() {
+    char dir[] = "/tmp/spill_log_test.XXXXXX";
+    ASSERT_TRUE(mkdtemp(dir) != NULL);
+    dir_ = dir;
+    path_ = dir_ + "/spill";
+  }
+  virtual void TearDown() {
+    unlink(path_.c_str());
+    unlink((path_ + ".replay").c_str());
+    rmdir(dir_.c_str());
+  }
+
+  // Sink that keeps everything, or rejects from the |reject_from|th batch.
+  bool Collect(std::vector<Message> const& batch) {
+    if (batches_++ >= reject_from_)
+      return false;
+    received_.insert(received_.end(), batch.begin(), batch.end());
+    return true;
+  }
+
+  size_t Replay(SpillLog* log, size_t batch_size) {
+    return log->Replay(std::tr1::bind(&SpillLogTest::Collect, this,
+                                      std::tr1::placeholders::_1),
+                       batch_size);
+  }
+
+  long FileSize() {
+    FILE* file = fopen(path_.c_str(), "rb");
+    if (file == NULL)
+      return -1;
+    fseek(file, 0, SEEK_END);
+    long size = ftell(file);
+    fclose(file);
+    return size;
+  }
+
+  std::string dir_;
+  std::string path_;
+  std::vector<Message> received_;
+  int batches_ = 0;
+  int reject_from_ = 1 << 30;
+};
+
+}  // namespace
+
+TEST_F(SpillLogTest, ReplaysInOrderAndEmptiesTheLog) {
+  SpillLog log(path_);
+  EXPECT_FALSE(log.HasData());
+  std::vector<Message> msgs;
+  for (int i = 0; i < 5; ++i)
+    msgs.push_back(MakeTestMessage("receiver", i));
+  ASSERT_TRUE(log.Append(msgs));
+  EXPECT_TRUE(log.HasData());
+
+  EXPECT_EQ(5u, Replay(&log, 2));
+  EXPECT_EQ(3, batches_);
+  ASSERT_EQ(5u, received_.size());
+  for (int i = 0; i < 5; ++i)
+    EXPECT_EQ(msgs[i].msg_id, received_[i].msg_id);
+  EXPECT_FALSE(log.HasData());
+  EXPECT_EQ(0u, Replay(&log, 2));
+}
+
+TEST_F(SpillLogTest, SurvivesReopen) {
+  {
+    SpillLog log(path_);
+    ASSERT_TRUE(log.Append(OneMessage(7)));
+  }
+  SpillLog log(path_);
+  EXPECT_TRUE(log.HasData());
+  EXPECT_EQ(1u, Replay(&log, 10));
+  ASSERT_EQ(1u, received_.size());
+  EXPECT_EQ("message 7", received_[0].msg);
+}
+
+TEST_F(SpillLogTest, RejectedBatchesAreKept) {
+  SpillLog log(path_);
+  std::vector<Message> msgs;
+  for (int i = 0; i < 6; ++i)
+    msgs.push_back(MakeTestMessage("receiver", i));
+  ASSERT_TRUE(log.Append(msgs));
+
+  reject_from_ = 1;
+  EXPECT_EQ(2u, Replay(&log, 2));
+  EXPECT_TRUE(log.HasData());
+
+  received_.clear();
+  batches_ = 0;
+  reject_from_ = 1 << 30;
+  EXPECT_EQ(4u, Replay(&log, 2));
+  ASSERT_EQ(4u, received_.size());
+  EXPECT_EQ("2", received_[0].msg_id);
+  EXPECT_EQ("5", received_[3].msg_id);
+}
+
+TEST_F(SpillLogTest, CorruptRecordDropsTheTail) {
+  {
+    SpillLog log(path_);
+    ASSERT_TRUE(log.Append(OneMessage(0)));
+  }
+  long first_end = FileSize();
+  {
+    SpillLog log(path_);
+    ASSERT_TRUE(log.Append(OneMessage(1)));
+    ASSERT_TRUE(log.Append(OneMessage(2)));
+  }
+  // Flip a payload byte of the second record, so its checksum fails.
+  FILE* file = fopen(path_.c_str(), "r+b");
+  ASSERT_TRUE(file != NULL);
+  fseek(file, first_end + 8 + 4, SEEK_SET);
+  int byte = fgetc(file);
+  fseek(file, first_end + 8 + 4, SEEK_SET);
+  fputc(byte ^ 0xff, file);
+  fclose(file);
+
+  SpillLog log(path_);
+  EXPECT_EQ(1u, Replay(&log, 10));
+  ASSERT_EQ(1u, received_.size());
+  EXPECT_EQ("0", received_[0].msg_id);
+  EXPECT_FALSE(log.HasData());
+}
+
+TEST_F(SpillLogTest, BadLengthDropsTheTail) {
+  {
+    SpillLog log(path_);
+    ASSERT_TRUE(log.Append(OneMessage(0)));
+  }
+  long first_end = FileSize();
+  // A header claiming a 4GB record, followed by a few bytes.
+  FILE* file = fopen(path_.c_str(), "ab");
+  ASSERT_TRUE(file != NULL);
+  const char header[] = "\xff\xff\xff\xff\0\0\0\0tail";
+  fwrite(header, 1, sizeof(header) - 1, file);
+  fclose(file);
+  ASSERT_GT(FileSize(), first_end);
+
+  SpillLog log(path_);
+  EXPECT_EQ(1u, Replay(&log, 10));
+  ASSERT_EQ(1u, received_.size());
+}
+
+TEST_F(SpillLogTest, TornTailIsIgnored) {
+  {
+    SpillLog log(path_);
+    ASSERT_TRUE(log.Append(OneMessage(0)));
+    ASSERT_TRUE(log.Append(OneMessage(1)));
+  }
+  ASSERT_EQ(0, truncate(path_.c_str(), FileSize() - 3));
+
+  SpillLog log(path_);
+  EXPECT_EQ(1u, Replay(&log, 10));
+  ASSERT_EQ(1u, received_.size());
+  EXPECT_EQ("0", received_[0].msg_id);
+}
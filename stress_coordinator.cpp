@@ -0,0 +1,385 @@
+#include "stress_coordinator.h"
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <algorithm>
+
+#include "common/base/timestamp.h"
+#include "thirdparty/gflags/gflags.h"
+#include "thirdparty/glog/logging.h"
+
+DEFINE_int32(stress_workers, 0,
+             "Run as coordinator of this many local worker processes");
+DEFINE_int32(stress_remote_workers, 0,
+             "Workers on other hosts the coordinator waits for as well");
+DEFINE_string(stress_coordinator, "",
+              "host:port of the coordinator, makes this process a worker");
+DEFINE_string(stress_listen_ip, "127.0.0.1",
+              "Address the coordinator accepts workers on");
+DEFINE_int32(stress_port, 0, "Port of the coordinator, 0 picks a free one");
+DEFINE_int32(stress_start_timeout_ms, 120000,
+             "Time allowed for every worker to finish setup and connect");
+DEFINE_int32(stress_run_timeout_ms, 3600000,
+             "Time allowed after the start for every worker to report");
+
+namespace {
+
+const char kReady[] = "READY";
+const char kStart[] = "START";
+
+void AppendUint64(uint64_t value, std::string* out) {
+  for (int i = 0; i < 8; ++i)
+    out->push_back(static_cast<char>(value >> (8 * i)));
+}
+
+uint64_t ReadUint64(const char* pos) {
+  uint64_t value = 0;
+  for (int i = 0; i < 8; ++i)
+    value |= static_cast<uint64_t>(static_cast<unsigned char>(pos[i]))
+        << (8 * i);
+  return value;
+}
+
+bool WriteAll(int fd, const char* data, size_t size) {
+  while (size > 0) {
+    ssize_t n = send(fd, data, size, MSG_NOSIGNAL);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n <= 0)
+      return false;
+    data += n;
+    size -= n;
+  }
+  return true;
+}
+
+bool ReadAll(int fd, char* data, size_t size) {
+  while (size > 0) {
+    ssize_t n = recv(fd, data, size, 0);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n <= 0)
+      return false;
+    data += n;
+    size -= n;
+  }
+  return true;
+}
+
+// Bounds every recv on |fd| by |timeout_ms|, 0 for none.
+void SetRecvTimeout(int fd, int64_t timeout_ms) {
+  struct timeval tv;
+  tv.tv_sec = timeout_ms / 1000;
+  tv.tv_usec = (timeout_ms % 1000) * 1000;
+  setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+}
+
+// Frames are a 4-byte little-endian length followed by the payload.
+bool WriteFrame(int fd, std::string const& payload) {
+  std::string frame;
+  for (int i = 0; i < 4; ++i)
+    frame.push_back(static_cast<char>(payload.size() >> (8 * i)));
+  frame += payload;
+  return WriteAll(fd, frame.data(), frame.size());
+}
+
+bool ReadFrame(int fd, std::string* payload) {
+  unsigned char header[4];
+  if (!ReadAll(fd, reinterpret_cast<char*>(header), sizeof(header)))
+    return false;
+  uint32_t size = header[0] | header[1] << 8 | header[2] << 16 |
+      static_cast<uint32_t>(header[3]) << 24;
+  if (size > (64 << 20))
+    return false;
+  payload->resize(size);
+  return size == 0 || ReadAll(fd, &(*payload)[0], size);
+}
+
+}  // namespace
+
+void StressReport::Merge(StressReport const& other) {
+  operations += other.operations;
+  successes += other.successes;
+  elapsed_ms = std::max(elapsed_ms, other.elapsed_ms);
+  latencies.Merge(other.latencies);
+}
+
+void StressReport::Serialize(std::string* out) const {
+  out->clear();
+  AppendUint64(operations, out);
+  AppendUint64(successes, out);
+  AppendUint64(elapsed_ms, out);
+  std::string histogram;
+  latencies.Serialize(&histogram);
+  *out += histogram;
+}
+
+bool StressReport::Parse(std::string const& data) {
+  if (data.size() < 24)
+    return false;
+  operations = ReadUint64(data.data());
+  successes = ReadUint64(data.data() + 8);
+  elapsed_ms = ReadUint64(data.data() + 16);
+  return latencies.Parse(data.data() + 24, data.size() - 24);
+}
+
+void LogStressReport(StressReport const& report, int64_t elapsed_ms) {
+  LatencyHistogram const& latencies = report.latencies;
+  LOG(INFO) << "Operation count: " << report.operations;
+  LOG(INFO) << "Success count: " << report.successes;
+  LOG(INFO) << "QPS: "
+            << report.operations * 1000 / std::max<int64_t>(elapsed_ms, 1);
+  LOG(INFO) << "Average latency: " << latencies.Mean() / 1000.0 << " ms";
+  LOG(INFO) << "Min latency: " << latencies.min() / 1000.0 << " ms";
+  LOG(INFO) << "Max latency: " << latencies.max() / 1000.0 << " ms";
+  LOG(INFO) << ".95 latency: " << latencies.Percentile(0.95) / 1000.0
+            << " ms";
+  LOG(INFO) << ".99 latency: " << latencies.Percentile(0.99) / 1000.0
+            << " ms";
+  LOG(INFO) << ".999 latency: " << latencies.Percentile(0.999) / 1000.0
+            << " ms";
+}
+
+StressCoordinator::StressCoordinator() : listen_fd_(-1), port_(0) {
+}
+
+StressCoordinator::~StressCoordinator() {
+  for (size_t i = 0; i < worker_fds_.size(); ++i)
+    close(worker_fds_[i]);
+  if (listen_fd_ >= 0)
+    close(listen_fd_);
+  ReapWorkers();
+}
+
+bool StressCoordinator::Enabled() {
+  return FLAGS_stress_workers > 0 || FLAGS_stress_remote_workers > 0;
+}
+
+bool StressCoordinator::Run(char** argv) {
+  if (!Listen() || !SpawnWorkers(argv))
+    return false;
+  size_t num_workers = FLAGS_stress_workers + FLAGS_stress_remote_workers;
+  LOG(INFO) << "Waiting for " << num_workers << " stress workers on "
+            << FLAGS_stress_listen_ip << ":" << port_;
+
+  int64_t deadline = GetTimeStampInMs() + FLAGS_stress_start_timeout_ms;
+  while (worker_fds_.size() < num_workers) {
+    int64_t remaining = deadline - GetTimeStampInMs();
+    struct pollfd pfd = { listen_fd_, POLLIN, 0 };
+    if (remaining <= 0 || poll(&pfd, 1, remaining) == 0) {
+      LOG(ERROR) << "Only " << worker_fds_.size() << " of " << num_workers
+                 << " stress workers connected";
+      return false;
+    }
+    int fd = accept(listen_fd_, NULL, NULL);
+    if (fd < 0)
+      continue;
+    // Workers send READY as soon as they connect, so one that stays silent
+    // is dropped instead of hanging the run.
+    SetRecvTimeout(fd, std::max<int64_t>(deadline - GetTimeStampInMs(), 1));
+    std::string ready;
+    if (!ReadFrame(fd, &ready) || ready != kReady) {
+      LOG(WARNING) << "Dropping a stress worker that did not send READY";
+      close(fd);
+      continue;
+    }
+    SetRecvTimeout(fd, 0);
+    worker_fds_.push_back(fd);
+  }
+
+  int64_t begin_time = GetTimeStampInMs();
+  for (size_t i = 0; i < worker_fds_.size(); ++i) {
+    if (!WriteFrame(worker_fds_[i], kStart)) {
+      LOG(ERROR) << "Lost stress worker " << i << " before the start";
+      return false;
+    }
+  }
+
+  // Reports arrive in any order; poll so the window ends with the last one.
+  StressReport total;
+  std::vector<struct pollfd> pfds;
+  for (size_t i = 0; i < worker_fds_.size(); ++i) {
+    struct pollfd pfd = { worker_fds_[i], POLLIN, 0 };
+    pfds.push_back(pfd);
+  }
+  size_t reported = 0;
+  size_t failed = 0;
+  int64_t run_deadline = begin_time + FLAGS_stress_run_timeout_ms;
+  while (reported + failed < pfds.size()) {
+    // A worker that hangs without closing its socket must not hang the
+    // coordinator as well.
+    int64_t remaining = run_deadline - GetTimeStampInMs();
+    int ready = remaining > 0 ? poll(&pfds[0], pfds.size(), remaining) : 0;
+    if (ready < 0) {
+      if (errno == EINTR)
+        continue;
+      PLOG(ERROR) << "poll failed while waiting for stress reports";
+      return false;
+    }
+    if (ready == 0) {
+      LOG(ERROR) << pfds.size() - reported - failed
+                 << " stress workers did not report in time";
+      failed = pfds.size() - reported;
+      // Reaping would wait for them otherwise. The ones that did report
+      // have nothing left to do.
+      for (size_t i = 0; i < worker_pids_.size(); ++i)
+        kill(worker_pids_[i], SIGKILL);
+      break;
+    }
+    for (size_t i = 0; i < pfds.size(); ++i) {
+      if (pfds[i].fd < 0 || pfds[i].revents == 0)
+        continue;
+      SetRecvTimeout(pfds[i].fd,
+                     std::max<int64_t>(run_deadline - GetTimeStampInMs(), 1));
+      std::string payload;
+      StressReport report;
+      if (ReadFrame(pfds[i].fd, &payload) && report.Parse(payload)) {
+        total.Merge(report);
+        ++reported;
+      } else {
+        LOG(ERROR) << "Stress worker " << i << " exited without a report";
+        ++failed;
+      }
+      pfds[i].fd = -1;
+    }
+  }
+  int64_t end_time = GetTimeStampInMs();
+
+  LOG(INFO) << "Stress workers reported: " << reported << " of "
+            << pfds.size();
+  LOG(INFO) << "Slowest worker: " << total.elapsed_ms << " ms";
+  LogStressReport(total, end_time - begin_time);
+  return failed == 0;
+}
+
+bool StressCoordinator::Listen() {
+  listen_fd_ = socket(AF_INET, SOCK_STREAM, 0);
+  if (listen_fd_ < 0) {
+    PLOG(ERROR) << "socket failed";
+    return false;
+  }
+  int on = 1;
+  setsockopt(listen_fd_, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+  struct sockaddr_in addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons(FLAGS_stress_port);
+  if (inet_pton(AF_INET, FLAGS_stress_listen_ip.c_str(),
+                &addr.sin_addr) != 1) {
+    LOG(ERROR) << "Bad --stress_listen_ip " << FLAGS_stress_listen_ip;
+    return false;
+  }
+  socklen_t len = sizeof(addr);
+  if (bind(listen_fd_, reinterpret_cast<struct sockaddr*>(&addr), len) < 0 ||
+      listen(listen_fd_, 128) < 0 ||
+      getsockname(listen_fd_, reinterpret_cast<struct sockaddr*>(&addr),
+                  &len) < 0) {
+    PLOG(ERROR) << "Failed to listen on " << FLAGS_stress_listen_ip << ":"
+                << FLAGS_stress_port;
+    return false;
+  }
+  port_ = ntohs(addr.sin_port);
+  return true;
+}
+
+bool StressCoordinator::SpawnWorkers(char** argv) {
+  // Workers get the coordinator's own flags; the later flags win.
+  std::vector<std::string> args;
+  for (char** arg = argv; *arg != NULL; ++arg)
+    args.push_back(*arg);
+  args.push_back("--stress_workers=0");
+  args.push_back("--stress_remote_workers=0");
+  // The wildcard address is only valid to bind to.
+  std::string host = FLAGS_stress_listen_ip;
+  if (host == "0.0.0.0")
+    host = "127.0.0.1";
+  args.push_back("--stress_coordinator=" + host + ":" +
+                 std::to_string(port_));
+  std::vector<char*> exec_args;
+  for (size_t i = 0; i < args.size(); ++i)
+    exec_args.push_back(&args[i][0]);
+  exec_args.push_back(NULL);
+
+  for (int i = 0; i < FLAGS_stress_workers; ++i) {
+    pid_t pid = fork();
+    if (pid < 0) {
+      PLOG(ERROR) << "fork failed";
+      return false;
+    }
+    if (pid == 0) {
+      close(listen_fd_);
+      execv("/proc/self/exe", &exec_args[0]);
+      _exit(127);
+    }
+    worker_pids_.push_back(pid);
+  }
+  return true;
+}
+
+void StressCoordinator::ReapWorkers() {
+  for (size_t i = 0; i < worker_pids_.size(); ++i) {
+    int status;
+    if (waitpid(worker_pids_[i], &status, 0) == worker_pids_[i] &&
+        !(WIFEXITED(status) && WEXITSTATUS(status) == 0))
+      LOG(WARNING) << "Stress worker " << worker_pids_[i]
+                   << " exited with status " << status;
+  }
+  worker_pids_.clear();
+}
+
+StressWorker::StressWorker() : fd_(-1) {
+}
+
+StressWorker::~StressWorker() {
+  if (fd_ >= 0)
+    close(fd_);
+}
+
+bool StressWorker::Enabled() {
+  return !FLAGS_stress_coordinator.empty();
+}
+
+bool StressWorker::WaitForStart() {
+  std::string const& address = FLAGS_stress_coordinator;
+  size_t colon = address.rfind(':');
+  struct sockaddr_in addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  if (colon == std::string::npos ||
+      inet_pton(AF_INET, address.substr(0, colon).c_str(),
+                &addr.sin_addr) != 1) {
+    LOG(ERROR) << "Bad --stress_coordinator " << address;
+    return false;
+  }
+  addr.sin_port = htons(atoi(address.c_str() + colon + 1));
+  fd_ = socket(AF_INET, SOCK_STREAM, 0);
+  if (fd_ < 0 ||
+      connect(fd_, reinterpret_cast<struct sockaddr*>(&addr),
+              sizeof(addr)) < 0) {
+    PLOG(ERROR) << "Failed to connect to stress coordinator " << address;
+    return false;
+  }
+  std::string start;
+  if (!WriteFrame(fd_, kReady) || !ReadFrame(fd_, &start) ||
+      start != kStart) {
+    LOG(ERROR) << "Stress coordinator " << address << " went away";
+    return false;
+  }
+  return true;
+}
+
+bool StressWorker::SendReport(StressReport const& report) {
+  std::string payload;
+  report.Serialize(&payload);
+  return WriteFrame(fd_, payload);
+}
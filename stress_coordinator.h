@@ -0,0 +1,73 @@
+#ifndef STRESS_COORDINATOR_H_
+#define STRESS_COORDINATOR_H_
+
+#include <stdint.h>
+
+#include <string>
+#include <vector>
+
+#include "latency_histogram.h"
+
+// Results of one stress worker, or of all of them once merged.
+struct StressReport {
+  StressReport() : operations(0), successes(0), elapsed_ms(0) {}
+
+  void Merge(StressReport const& other);
+  void Serialize(std::string* out) const;
+  bool Parse(std::string const& data);
+
+  uint64_t operations;
+  uint64_t successes;
+  int64_t elapsed_ms;  // the slowest worker's when merged
+  LatencyHistogram latencies;
+};
+
+// Logs QPS and latency percentiles of |report| over |elapsed_ms|.
+void LogStressReport(StressReport const& report, int64_t elapsed_ms);
+
+// Coordinator mode of the stress drivers, on with --stress_workers. The
+// coordinator starts that many copies of the running binary as workers,
+// plus accepts --stress_remote_workers more started by hand on other hosts
+// with --stress_coordinator=<host>:<port>. Once every worker has finished
+// its setup and connected, all get START at the same moment; afterwards
+// each sends back its StressReport, and the coordinator logs the merged
+// result with QPS over the common run window.
+class StressCoordinator {
+ public:
+  StressCoordinator();
+  ~StressCoordinator();
+
+  static bool Enabled();
+  // Runs the whole coordinated stress with the flags in |argv|, which
+  // must not have been stripped of its flags. Returns whether every worker
+  // reported.
+  bool Run(char** argv);
+
+ private:
+  bool Listen();
+  bool SpawnWorkers(char** argv);
+  void ReapWorkers();
+
+  int listen_fd_;
+  int port_;
+  std::vector<int> worker_fds_;
+  std::vector<int> worker_pids_;
+};
+
+// Worker side: connects to --stress_coordinator.
+class StressWorker {
+ public:
+  StressWorker();
+  ~StressWorker();
+
+  static bool Enabled();
+  // Tells the coordinator that setup is done and blocks until the
+  // synchronized start. Returns false if the coordinator is unreachable.
+  bool WaitForStart();
+  bool SendReport(StressReport const& report);
+
+ private:
+  int fd_;
+};
+
+#endif // STRESS_COORDINATOR_H_
@@ -0,0 +1,20 @@
+#ifndef TEST_MESSAGE_H_
+#define TEST_MESSAGE_H_
+
+#include <string>
+
+#include "common/idl/message_types.h"
+
+// Message number |i| of |receiver| in tests: ts 1000 + i, msg_id i.
+inline Message MakeTestMessage(std::string const& receiver, int i) {
+  Message message;
+  message.__set_receiver_id(receiver);
+  message.__set_timestamp(std::to_string(1000 + i));
+  message.__set_msg_id(std::to_string(i));
+  message.__set_group_id("0");
+  message.__set_msg("message " + std::to_string(i));
+  message.__set_sender_id("sender");
+  return message;
+}
+
+#endif // TEST_MESSAGE_H_
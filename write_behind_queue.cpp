@@ -0,0 +1,158 @@
+#include "write_behind_queue.h"
+
+#include <algorithm>
+
+#include "common/base/timestamp.h"
+#include "lock_guard.h"
+#include "thirdparty/gflags/gflags.h"
+#include "thirdparty/glog/logging.h"
+
+DEFINE_int32(write_behind_linger_ms, 2,
+             "How long a flusher waits for a batch to fill up");
+DEFINE_int32(write_behind_retry_ms, 500,
+             "Pause of a flusher after a batch failed to reach Cassandra");
+
+WriteBehindQueue::WriteBehindQueue(FlushFunction flush, size_t capacity,
+                                   size_t batch_size,
+                                   std::string const& spill_path)
+    : flush_(flush), capacity_(capacity), batch_size_(batch_size),
+      spill_log_(spill_path), stopped_(false), spill_rest_(false),
+      replay_after_ms_(0), spiller_(NULL) {
+}
+
+void WriteBehindQueue::Start(int num_flushers) {
+  spiller_ = new boost::thread(&WriteBehindQueue::SpillLoop, this);
+  for (int i = 0; i < num_flushers; ++i)
+    flushers_.push_back(
+        new boost::thread(&WriteBehindQueue::FlushLoop, this));
+}
+
+WriteBehindQueue::~WriteBehindQueue() {
+  Stop();
+}
+
+bool WriteBehindQueue::Push(const Message& message) {
+  LockGuard<boost::mutex> lock(mutex_);
+  if (stopped_)
+    return false;
+  if (queue_.size() < capacity_) {
+    queue_.push_back(message);
+    if (queue_.size() >= batch_size_)
+      not_empty_.notify_one();
+    return true;
+  }
+  if (overflow_.size() >= capacity_)
+    return false;
+  overflow_.push_back(message);
+  overflowed_.notify_one();
+  return true;
+}
+
+void WriteBehindQueue::Stop() {
+  {
+    LockGuard<boost::mutex> lock(mutex_);
+    if (stopped_)
+      return;
+    stopped_ = true;
+  }
+  not_empty_.notify_all();
+  overflowed_.notify_all();
+  for (size_t i = 0; i < flushers_.size(); ++i) {
+    flushers_[i]->join();
+    delete flushers_[i];
+  }
+  flushers_.clear();
+  if (spiller_ != NULL) {
+    spiller_->join();
+    delete spiller_;
+    spiller_ = NULL;
+  }
+}
+
+size_t WriteBehindQueue::Size() {
+  LockGuard<boost::mutex> lock(mutex_);
+  return queue_.size();
+}
+
+void WriteBehindQueue::FlushLoop() {
+  std::vector<Message> batch;
+  for (;;) {
+    bool stopping;
+    {
+      boost::unique_lock<boost::mutex> lock(mutex_);
+      if (queue_.size() < batch_size_ && !stopped_)
+        not_empty_.wait_for(lock, boost::chrono::milliseconds(
+                                      FLAGS_write_behind_linger_ms));
+      stopping = stopped_;
+      if (queue_.empty() && stopping)
+        return;
+      size_t n = std::min(queue_.size(), batch_size_);
+      batch.assign(queue_.begin(), queue_.begin() + n);
+      queue_.erase(queue_.begin(), queue_.begin() + n);
+    }
+    if (!batch.empty() && (spill_rest_ || !Deliver(batch))) {
+      spill_log_.Append(batch);
+      // While stopping, one failure is enough to send the rest of the queue
+      // straight to the log instead of waiting a deadline per batch.
+      if (stopping)
+        spill_rest_ = true;
+      else
+        boost::this_thread::sleep_for(
+            boost::chrono::milliseconds(FLAGS_write_behind_retry_ms));
+      continue;
+    }
+    if (spill_log_.HasData() && !stopping && !ReplaySpillLog())
+      boost::this_thread::sleep_for(
+          boost::chrono::milliseconds(FLAGS_write_behind_retry_ms));
+  }
+}
+
+// Group commit: everything that overflowed while the last append ran goes
+// out with the next one.
+void WriteBehindQueue::SpillLoop() {
+  std::vector<Message> batch;
+  for (;;) {
+    {
+      boost::unique_lock<boost::mutex> lock(mutex_);
+      while (overflow_.empty() && !stopped_)
+        overflowed_.wait(lock);
+      if (overflow_.empty())
+        return;
+      batch.swap(overflow_);
+    }
+    if (!spill_log_.Append(batch))
+      LOG(ERROR) << "Lost " << batch.size() << " messages that overflowed "
+                 << "the write-behind queue";
+    batch.clear();
+  }
+}
+
+bool WriteBehindQueue::ReplaySpillLog() {
+  // Other flushers must not retry right after a rejected replay either:
+  // every replay renames, rereads and rewrites the whole log.
+  if (GetTimeStampInMs() < replay_after_ms_.load())
+    return true;
+  bool rejected = false;
+  spill_log_.Replay([this, &rejected](std::vector<Message> const& batch) {
+                      if (Deliver(batch))
+                        return true;
+                      rejected = true;
+                      return false;
+                    }, batch_size_);
+  if (rejected)
+    replay_after_ms_ = GetTimeStampInMs() + FLAGS_write_behind_retry_ms;
+  return !rejected;
+}
+
+// Returns false if the cluster looks unreachable and |batch| should be
+// retried later.
+bool WriteBehindQueue::Deliver(std::vector<Message> const& batch) {
+  OfflineStatus::type status = flush_(batch);
+  if (status == OfflineStatus::INVALID) {
+    // Retrying would fail the same way, so the batch is dropped.
+    LOG(ERROR) << "Dropping " << batch.size() << " messages rejected by "
+               << "Cassandra";
+    return true;
+  }
+  return status == OfflineStatus::OK;
+}
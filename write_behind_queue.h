@@ -0,0 +1,69 @@
+#ifndef WRITE_BEHIND_QUEUE_H_
+#define WRITE_BEHIND_QUEUE_H_
+
+#include <stddef.h>
+
+#include <stdint.h>
+
+#include <atomic>
+#include <deque>
+#include <string>
+#include <vector>
+
+#include "common/idl/message_types.h"
+#include "offline_status.h"
+#include "spill_log.h"
+#include "thirdparty/boost/thread.hpp"
+
+// Bounded in-memory queue in front of Cassandra writes. Producers return
+// as soon as a message is queued; flusher threads drain it in batches via
+// the flush function. Batches that fail with TIMEOUT or UNAVAILABLE go to
+// a SpillLog that is replayed once a flush succeeds again. Messages that
+// arrive while the queue is full are handed to a spill thread, which
+// writes whatever has piled up with one append and sync, so a full queue
+// costs producers no disk I/O.
+class WriteBehindQueue {
+ public:
+  typedef std::tr1::function<OfflineStatus::type(
+      std::vector<Message> const& batch)> FlushFunction;
+
+  WriteBehindQueue(FlushFunction flush, size_t capacity, size_t batch_size,
+                   std::string const& spill_path);
+  ~WriteBehindQueue();
+
+  // Starts the flusher and spill threads. Until then messages are only
+  // queued, so the flush function need not be usable yet; a spill log left
+  // by the last run is replayed once the threads run.
+  void Start(int num_flushers);
+  // Never blocks on Cassandra or the disk. Returns false if the queue and
+  // the backlog of the spill thread are both full.
+  bool Push(const Message& message);
+  // Flushes what is queued and joins the flushers. Push fails afterwards.
+  void Stop();
+  size_t Size();
+
+ private:
+  void FlushLoop();
+  void SpillLoop();
+  bool Deliver(std::vector<Message> const& batch);
+  // Replays the spill log unless a replay was rejected during the last
+  // --write_behind_retry_ms. Returns false if this replay was rejected.
+  bool ReplaySpillLog();
+
+  FlushFunction flush_;
+  size_t capacity_;
+  size_t batch_size_;
+  SpillLog spill_log_;
+  std::deque<Message> queue_;
+  std::vector<Message> overflow_;  // for the spill thread
+  bool stopped_;
+  std::atomic<bool> spill_rest_;  // Stop gave up on reaching Cassandra
+  std::atomic<int64_t> replay_after_ms_;
+  boost::mutex mutex_;  // guards queue_, overflow_ and stopped_
+  boost::condition_variable not_empty_;
+  boost::condition_variable overflowed_;
+  std::vector<boost::thread*> flushers_;
+  boost::thread* spiller_;
+};
+
+#endif // WRITE_BEHIND_QUEUE_H_
@@ -0,0 +1,129 @@
+#include "write_behind_queue.h"
+
+#include <stdlib.h>
+#include <unistd.h>
+
+#include <string>
+#include <vector>
+
+#include "lock_guard.h"
+#include "test_message.h"
+#include "thirdparty/boost/scoped_ptr.hpp"
+#include "thirdparty/gtest/gtest.h"
+
+namespace {
+
+class WriteBehindQueueTest : public testing::Test {
+ protected:
+  virtual void SetUp() {
+    char dir[] = "/tmp/write_behind_queue_test.XXXXXX";
+    ASSERT_TRUE(mkdtemp(dir) != NULL);
+    dir_ = dir;
+    path_ = dir_ + "/spill";
+  }
+  virtual void TearDown() {
+    unlink(path_.c_str());
+    unlink((path_ + ".replay").c_str());
+    rmdir(dir_.c_str());
+  }
+
+  OfflineStatus::type Flush(std::vector<Message> const& batch) {
+    LockGuard<boost::mutex> lock(mutex_);
+    ++flushes_;
+    if (status_ == OfflineStatus::OK)
+      flushed_.insert(flushed_.end(), batch.begin(), batch.end());
+    return status_;
+  }
+
+  WriteBehindQueue* NewQueue(size_t capacity, size_t batch_size) {
+    return new WriteBehindQueue(
+        std::tr1::bind(&WriteBehindQueueTest::Flush, this,
+                       std::tr1::placeholders::_1),
+        capacity, batch_size, path_);
+  }
+
+  // Waits up to a second for |count| flushed messages.
+  size_t WaitForFlushed(size_t count) {
+    for (int i = 0; i < 100; ++i) {
+      {
+        LockGuard<boost::mutex> lock(mutex_);
+        if (flushed_.size() >= count)
+          return flushed_.size();
+      }
+      boost::this_thread::sleep_for(boost::chrono::milliseconds(10));
+    }
+    LockGuard<boost::mutex> lock(mutex_);
+    return flushed_.size();
+  }
+
+  std::string dir_;
+  std::string path_;
+  boost::mutex mutex_;
+  OfflineStatus::type status_ = OfflineStatus::OK;
+  int flushes_ = 0;
+  std::vector<Message> flushed_;
+};
+
+}  // namespace
+
+TEST_F(WriteBehindQueueTest, FlushesOnlyOnceStarted) {
+  boost::scoped_ptr<WriteBehindQueue> queue(NewQueue(100, 10));
+  for (int i = 0; i < 3; ++i)
+    ASSERT_TRUE(queue->Push(MakeTestMessage("receiver", i)));
+  boost::this_thread::sleep_for(boost::chrono::milliseconds(20));
+  EXPECT_EQ(0, flushes_);
+
+  queue->Start(1);
+  queue->Stop();
+  EXPECT_EQ(3u, flushed_.size());
+  EXPECT_FALSE(queue->Push(MakeTestMessage("receiver", 3)));
+}
+
+TEST_F(WriteBehindQueueTest, OverflowIsSpilledAndReplayed) {
+  boost::scoped_ptr<WriteBehindQueue> queue(NewQueue(2, 10));
+  for (int i = 0; i < 4; ++i)
+    ASSERT_TRUE(queue->Push(MakeTestMessage("receiver", i)));
+  // Queue and spill backlog are both full.
+  EXPECT_FALSE(queue->Push(MakeTestMessage("receiver", 4)));
+
+  queue->Start(1);
+  EXPECT_EQ(4u, WaitForFlushed(4));
+  queue->Stop();
+  EXPECT_EQ("0", flushed_[0].msg_id);
+  EXPECT_EQ("1", flushed_[1].msg_id);
+}
+
+TEST_F(WriteBehindQueueTest, LeftoverSpillLogIsReplayed) {
+  {
+    SpillLog log(path_);
+    ASSERT_TRUE(log.Append(std::vector<Message>(
+        1, MakeTestMessage("receiver", 7))));
+  }
+  boost::scoped_ptr<WriteBehindQueue> queue(NewQueue(100, 10));
+  queue->Start(2);
+  ASSERT_EQ(1u, WaitForFlushed(1));
+  queue->Stop();
+  EXPECT_EQ("7", flushed_[0].msg_id);
+}
+
+TEST_F(WriteBehindQueueTest, RejectedReplayBacksOff) {
+  {
+    SpillLog log(path_);
+    ASSERT_TRUE(log.Append(std::vector<Message>(
+        1, MakeTestMessage("receiver", 7))));
+  }
+  status_ = OfflineStatus::UNAVAILABLE;
+  boost::scoped_ptr<WriteBehindQueue> queue(NewQueue(100, 10));
+  queue->Start(2);
+  // Far less than --write_behind_retry_ms, so only one replay may run.
+  boost::this_thread::sleep_for(boost::chrono::milliseconds(100));
+  queue->Stop();
+  EXPECT_EQ(1, flushes_);
+
+  // The message is still in the log for the next run.
+  status_ = OfflineStatus::OK;
+  queue.reset(NewQueue(100, 10));
+  queue->Start(1);
+  ASSERT_EQ(1u, WaitForFlushed(1));
+  queue->Stop();
+}